@@ -53,6 +53,21 @@ bool file::try_open(string_view path, bool readonly)
 	return true;
 }
 
+// Fails if the file already exists, which makes it suitable for lock files.
+bool file::try_create_new(string_view path)
+{
+	HANDLE hFile = ::CreateFileW(to_utf16(path).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, CREATE_NEW, 0, 0);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		DWORD dwError = ::GetLastError();
+		if (dwError == ERROR_FILE_EXISTS)
+			return false;
+		throw windows_error(dwError);
+	}
+	m_fd = (intptr_t)hFile;
+	return true;
+}
+
 void file::close()
 {
 	if (m_fd)
@@ -67,6 +82,30 @@ bool file::is_open() const
 	return m_fd != 0;
 }
 
+file_offset_t file::size() const
+{
+	LARGE_INTEGER li;
+	if (!::GetFileSizeEx((HANDLE)m_fd, &li))
+		throw windows_error(::GetLastError());
+	return li.QuadPart;
+}
+
+// File times count 100ns intervals since 1601.
+static void filetime_to_unix(FILETIME const & ft, uint32_t & sec, uint32_t & nsec)
+{
+	uint64_t t = (((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime) - 116444736000000000;
+	sec = (uint32_t)(t / 10000000);
+	nsec = (uint32_t)(t % 10000000) * 100;
+}
+
+void file::mtime(uint32_t & sec, uint32_t & nsec) const
+{
+	FILETIME ft;
+	if (!::GetFileTime((HANDLE)m_fd, 0, 0, &ft))
+		throw windows_error(::GetLastError());
+	filetime_to_unix(ft, sec, nsec);
+}
+
 file::ifile file::seekg(file_offset_t pos)
 {
 	return file::ifile(this, pos);
@@ -94,6 +133,88 @@ size_t file::read_abs(file_offset_t pos, uint8_t * p, size_t capacity)
 	return dwRead;
 }
 
+file_view::file_view()
+	: m_data(0), m_size(0)
+{
+}
+
+file_view::file_view(file_view && o)
+	: m_data(o.m_data), m_size(o.m_size)
+{
+	o.m_data = 0;
+	o.m_size = 0;
+}
+
+file_view::~file_view()
+{
+	this->unmap();
+}
+
+file_view & file_view::operator=(file_view && o)
+{
+	std::swap(m_data, o.m_data);
+	std::swap(m_size, o.m_size);
+	return *this;
+}
+
+bool file_view::try_map(file const & f)
+{
+	this->unmap();
+
+	file_offset_t size = f.size();
+	if (size == 0 || size != (size_t)size)
+		return false;
+
+	HANDLE hMapping = ::CreateFileMappingW((HANDLE)f.m_fd, 0, PAGE_READONLY, 0, 0, 0);
+	if (!hMapping)
+		return false;
+
+	// The view keeps the mapping object alive, we don't need the handle anymore.
+	void * p = ::MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+	::CloseHandle(hMapping);
+	if (!p)
+		return false;
+
+	m_data = (uint8_t const *)p;
+	m_size = (size_t)size;
+	return true;
+}
+
+void file_view::unmap()
+{
+	if (m_data)
+	{
+		::UnmapViewOfFile(m_data);
+		m_data = 0;
+		m_size = 0;
+	}
+}
+
+bool file_view::is_mapped() const
+{
+	return m_data != 0;
+}
+
+uint8_t const * file_view::data() const
+{
+	return m_data;
+}
+
+size_t file_view::size() const
+{
+	return m_size;
+}
+
+uint8_t const * file_view::begin() const
+{
+	return m_data;
+}
+
+uint8_t const * file_view::end() const
+{
+	return m_data + m_size;
+}
+
 struct dir_enum_proxy::impl
 {
 	HANDLE hFind;
@@ -194,9 +315,12 @@ directory_entry dir_enum_proxy::iterator::operator*() const
 {
 	assert(m_pimpl->m_pimpl);
 
+	WIN32_FIND_DATAW const & wfd = m_pimpl->m_pimpl->wfd;
+
 	directory_entry res;
 	res.name = m_pimpl->m_pimpl->current_name;
-	res.mtime = (uint32_t)(((uint64_t const &)m_pimpl->m_pimpl->wfd.ftLastWriteTime - 116444736000000000) / 10000000);
+	filetime_to_unix(wfd.ftLastWriteTime, res.mtime, res.mtime_nsec);
+	res.size = ((file_offset_t)wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow;
 	res.mode = 0x8000;
 	return res;
 }
@@ -264,6 +388,18 @@ void file::create(string_view path, string_view content)
 	write_all(of, (uint8_t const *)content.begin(), content.size());
 }
 
+void file::rename(string_view from, string_view to)
+{
+	if (!::MoveFileExW(to_utf16(from).c_str(), to_utf16(to).c_str(), MOVEFILE_REPLACE_EXISTING))
+		throw windows_error(::GetLastError());
+}
+
+void file::remove(string_view path)
+{
+	if (!::DeleteFileW(to_utf16(path).c_str()))
+		throw windows_error(::GetLastError());
+}
+
 bool file::exists(string_view path)
 {
 	DWORD attrs = ::GetFileAttributesW(to_utf16(path).c_str());
@@ -328,9 +464,15 @@ std::vector<directory_entry> listdir(string_view path, string_view mask)
 	{
 		if ((wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 || wfd.cFileName[0] != '.' || (wfd.cFileName[1] != 0 && (wfd.cFileName[1] != '.' || wfd.cFileName[2] != 0)))
 		{
+			uint32_t mtime;
+			uint32_t mtime_nsec;
+			filetime_to_unix(wfd.ftLastWriteTime, mtime, mtime_nsec);
+
 			res.emplace_back(
 				from_utf16(wfd.cFileName),
-				(uint32_t)(((uint64_t const &)wfd.ftLastWriteTime - 116444736000000000) / 10000000),
+				mtime,
+				mtime_nsec,
+				((file_offset_t)wfd.nFileSizeHigh << 32) | wfd.nFileSizeLow,
 				(wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)? 0x4000: 0x8000);
 		}
 
@@ -345,6 +487,30 @@ std::vector<directory_entry> listdir(string_view path, string_view mask)
 	}
 }
 
+bool try_stat(string_view path, directory_entry & de)
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!::GetFileAttributesExW(to_utf16(path).c_str(), GetFileExInfoStandard, &fad))
+	{
+		DWORD dwError = ::GetLastError();
+		if (dwError != ERROR_FILE_NOT_FOUND && dwError != ERROR_PATH_NOT_FOUND)
+			throw windows_error(dwError);
+		return false;
+	}
+
+	uint32_t mtime;
+	uint32_t mtime_nsec;
+	filetime_to_unix(fad.ftLastWriteTime, mtime, mtime_nsec);
+
+	de = directory_entry(
+		path_tail(path),
+		mtime,
+		mtime_nsec,
+		((file_offset_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow,
+		(fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)? 0x4000: 0x8000);
+	return true;
+}
+
 dir_entry_type directory_entry::type() const
 {
 
@@ -17,6 +17,7 @@ public:
 
 	void open(string_view path, bool readonly);
 	bool try_open(string_view path, bool readonly);
+	bool try_create_new(string_view path);
 	void close();
 	bool is_open() const;
 
@@ -66,6 +67,9 @@ public:
 		file_offset_t m_pos;
 	};
 
+	file_offset_t size() const;
+	void mtime(uint32_t & sec, uint32_t & nsec) const;
+
 	size_t read_abs(file_offset_t pos, uint8_t * p, size_t capacity);
 	size_t write_abs(file_offset_t pos, uint8_t const * p, size_t capacity);
 	ifile seekg(file_offset_t pos);
@@ -73,6 +77,9 @@ public:
 
 	static void create(string_view path, string_view content);
 
+	static void rename(string_view from, string_view to);
+	static void remove(string_view path);
+
 	static bool exists(string_view path);
 	static bool is_file(string_view path);
 	static bool is_directory(string_view path);
@@ -80,10 +87,38 @@ public:
 private:
 	intptr_t m_fd;
 
+	friend class file_view;
+
 	file(file const &);
 	file & operator=(file const &);
 };
 
+class file_view
+{
+public:
+	file_view();
+	file_view(file_view && o);
+	~file_view();
+	file_view & operator=(file_view && o);
+
+	bool try_map(file const & f);
+	void unmap();
+	bool is_mapped() const;
+
+	uint8_t const * data() const;
+	size_t size() const;
+
+	uint8_t const * begin() const;
+	uint8_t const * end() const;
+
+private:
+	uint8_t const * m_data;
+	size_t m_size;
+
+	file_view(file_view const &);
+	file_view & operator=(file_view const &);
+};
+
 enum class dir_entry_type
 {
 	directory,
@@ -96,20 +131,22 @@ struct directory_entry
 	std::string name;
 	std::string cannon_name;
 	uint32_t mtime;
+	uint32_t mtime_nsec;
+	file_offset_t size;
 	uint32_t mode;
 
 	directory_entry()
 	{
 	}
 
-	directory_entry(std::string name, uint32_t mtime, uint32_t mode)
-		: name(std::move(name)), cannon_name(cannonical_path(this->name)), mtime(mtime), mode(mode)
+	directory_entry(std::string name, uint32_t mtime, uint32_t mtime_nsec, file_offset_t size, uint32_t mode)
+		: name(std::move(name)), cannon_name(cannonical_path(this->name)), mtime(mtime), mtime_nsec(mtime_nsec), size(size), mode(mode)
 	{
 	}
 
 	directory_entry(directory_entry && o)
 		: name(std::move(o.name)), cannon_name(std::move(o.cannon_name)),
-		mtime(o.mtime), mode(o.mode)
+		mtime(o.mtime), mtime_nsec(o.mtime_nsec), size(o.size), mode(o.mode)
 	{
 	}
 
@@ -118,6 +155,8 @@ struct directory_entry
 		name = std::move(o.name);
 		cannon_name = std::move(o.cannon_name);
 		mtime = o.mtime;
+		mtime_nsec = o.mtime_nsec;
+		size = o.size;
 		mode = o.mode;
 		return *this;
 	}
@@ -127,6 +166,8 @@ struct directory_entry
 		lhs.name.swap(rhs.name);
 		lhs.cannon_name.swap(rhs.cannon_name);
 		std::swap(lhs.mtime, rhs.mtime);
+		std::swap(lhs.mtime_nsec, rhs.mtime_nsec);
+		std::swap(lhs.size, rhs.size);
 		std::swap(lhs.mode, rhs.mode);
 	}
 
@@ -185,6 +226,9 @@ inline dir_enum_proxy enumdir(string_view path, string_view mask = "*")
 
 std::vector<directory_entry> listdir(string_view path, string_view mask = "*");
 
+// Fills `de` with what `listdir` would report for `path`, returns false if it doesn't exist.
+bool try_stat(string_view path, directory_entry & de);
+
 bool make_directory(string_view path);
 
 #endif // FILE_H
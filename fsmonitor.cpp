@@ -0,0 +1,409 @@
+#include "fsmonitor.h"
+#include "object_id.h"
+#include "path.h"
+#include "utf.h"
+#include "win_error.h"
+#include <windows.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// The daemon of a working tree is found by the hash of its path.
+static std::wstring fsmonitor_pipe_name(string_view wd_path)
+{
+	return to_utf16("\\\\.\\pipe\\gh-fsmonitor-" + sha1(cannonical_path(wd_path)).base16());
+}
+
+// Cookies are files the client creates in the `.git` directory before asking.
+// Notifications arrive in order, so once the daemon has seen the cookie,
+// it has also seen every change made before the query.
+static char const cookie_prefix[] = "gh-fsmonitor-cookie-";
+
+// Queries are the client's token and the name of its cookie, separated by a newline.
+// Answers are the new token on its own line, followed by either a `*` if the
+// changes aren't known, or by the changed paths, each NUL-terminated and
+// prefixed with `+` if it was created and a space otherwise.
+bool fsmonitor_query(string_view wd_path, string_view token, std::string & new_token, bool & complete, std::vector<fsmonitor_change> & changes)
+{
+	std::wstring pipe_name = fsmonitor_pipe_name(wd_path);
+
+	static LONG cookie_counter = 0;
+	char cookie_buf[64];
+	sprintf(cookie_buf, "%s%lu-%ld", cookie_prefix, (unsigned long)::GetCurrentProcessId(), (long)::InterlockedIncrement(&cookie_counter));
+	std::string cookie = cookie_buf;
+
+	std::string query = token.to_string();
+	query += '\n';
+	query += cookie;
+
+	HANDLE hPipe;
+	for (;;)
+	{
+		hPipe = ::CreateFileW(pipe_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, 0, 0);
+		if (hPipe != INVALID_HANDLE_VALUE)
+			break;
+
+		DWORD dwError = ::GetLastError();
+		if (dwError == ERROR_FILE_NOT_FOUND)
+			return false;
+		if (dwError != ERROR_PIPE_BUSY)
+			throw windows_error(dwError);
+
+		// The daemon serves one query at a time.
+		if (!::WaitNamedPipeW(pipe_name.c_str(), 1000))
+			return false;
+	}
+
+	// The cookie is gone as soon as we close it. Without one,
+	// the answer might miss changes, so we don't ask.
+	HANDLE hCookie = ::CreateFileW(to_utf16(wd_path + "/.git/" + cookie).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		0, CREATE_NEW, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+	if (hCookie == INVALID_HANDLE_VALUE)
+	{
+		::CloseHandle(hPipe);
+		return false;
+	}
+
+	std::string answer;
+	try
+	{
+		DWORD mode = PIPE_READMODE_MESSAGE;
+		if (!::SetNamedPipeHandleState(hPipe, &mode, 0, 0))
+			throw windows_error(::GetLastError());
+
+		DWORD written;
+		if (!::WriteFile(hPipe, query.data(), (DWORD)query.size(), &written, 0))
+			throw windows_error(::GetLastError());
+
+		for (;;)
+		{
+			char buf[64*1024];
+			DWORD read;
+			BOOL success = ::ReadFile(hPipe, buf, sizeof buf, &read, 0);
+
+			DWORD dwError = success? ERROR_SUCCESS: ::GetLastError();
+			if (!success && dwError != ERROR_MORE_DATA)
+				throw windows_error(dwError);
+
+			answer.append(buf, read);
+			if (success)
+				break;
+		}
+	}
+	catch (...)
+	{
+		::CloseHandle(hCookie);
+		::CloseHandle(hPipe);
+		throw;
+	}
+
+	::CloseHandle(hCookie);
+	::CloseHandle(hPipe);
+
+	size_t token_end = answer.find('\n');
+	if (token_end == std::string::npos)
+		throw std::runtime_error("XXX invalid answer from fsmonitor");
+
+	new_token = answer.substr(0, token_end);
+	changes.clear();
+
+	string_view rest(answer.data() + token_end + 1, answer.data() + answer.size());
+	complete = rest != "*";
+	if (!complete)
+		return true;
+
+	while (!rest.empty())
+	{
+		size_t path_end = rest.find('\0');
+		if (path_end == rest.size() || path_end < 2)
+			throw std::runtime_error("XXX invalid answer from fsmonitor");
+
+		fsmonitor_change ch;
+		ch.path = rest.substr(1, path_end - 1);
+		ch.created = rest[0] == '+';
+		changes.push_back(std::move(ch));
+
+		rest = rest.substr(path_end + 1);
+	}
+
+	return true;
+}
+
+namespace {
+
+// The changes seen by the daemon, numbered as they come. Tokens name this
+// instance of the daemon and the number of the last change the client knows of.
+class fsmonitor_journal
+{
+public:
+	fsmonitor_journal()
+		: m_last_seq(0), m_first_seq(0), m_overflows(0)
+	{
+		char buf[64];
+		sprintf(buf, "%lu.%llu", (unsigned long)::GetCurrentProcessId(), (unsigned long long)::GetTickCount64());
+		m_instance = buf;
+	}
+
+	void add(std::string path, bool created)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+
+		entry e = { ++m_last_seq, std::move(path), created };
+		m_entries.push_back(std::move(e));
+
+		if (m_entries.size() > max_entries)
+		{
+			m_first_seq = m_entries.front().seq;
+			m_entries.pop_front();
+		}
+	}
+
+	// Changes were lost, clients will have to look at everything.
+	// Cookies may have been lost too, so nobody waits for theirs.
+	void overflow()
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_first_seq = ++m_last_seq;
+		m_entries.clear();
+		++m_overflows;
+		m_cookie_cv.notify_all();
+	}
+
+	void add_cookie(std::string name)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_cookies.insert(std::move(name));
+		m_cookie_cv.notify_all();
+	}
+
+	// Waits for the client's cookie before answering. If it doesn't show up,
+	// the changes aren't known.
+	std::string answer(string_view token, string_view cookie)
+	{
+		std::unique_lock<std::mutex> l(m_mutex);
+
+		uint64_t overflows = m_overflows;
+		std::string cookie_name = cookie;
+		bool seen = !cookie_name.empty() && m_cookie_cv.wait_for(l, std::chrono::seconds(5), [&] {
+			return m_cookies.count(cookie_name) != 0 || m_overflows != overflows;
+		});
+		m_cookies.erase(cookie_name);
+
+		char buf[32];
+		sprintf(buf, ":%llu\n", (unsigned long long)m_last_seq);
+		std::string res = m_instance + buf;
+
+		if (!seen)
+		{
+			res += "*";
+			return res;
+		}
+
+		size_t sep = token.rfind(':');
+		uint64_t seq = 0;
+		if (sep != token.size())
+			seq = strtoull(token.substr(sep + 1).to_string().c_str(), 0, 10);
+
+		if (sep == token.size() || token.substr(0, sep) != m_instance || seq < m_first_seq || seq > m_last_seq)
+		{
+			res += "*";
+			return res;
+		}
+
+		// Entries are numbered consecutively.
+		for (auto it = m_entries.begin() + (size_t)(seq - m_first_seq); it != m_entries.end(); ++it)
+		{
+			res += it->created? '+': ' ';
+			res += it->path;
+			res += '\0';
+		}
+
+		return res;
+	}
+
+private:
+	static size_t const max_entries = 1 << 20;
+
+	struct entry
+	{
+		uint64_t seq;
+		std::string path;
+		bool created;
+	};
+
+	std::mutex m_mutex;
+	std::string m_instance;
+	uint64_t m_last_seq;
+
+	// Changes with numbers greater than this one are in the journal.
+	uint64_t m_first_seq;
+	std::deque<entry> m_entries;
+
+	// Cookies seen, but not yet waited for.
+	std::set<std::string> m_cookies;
+	uint64_t m_overflows;
+	std::condition_variable m_cookie_cv;
+};
+
+class directory_watcher
+{
+public:
+	directory_watcher(string_view path, fsmonitor_journal & journal)
+		: m_journal(journal)
+	{
+		m_dir = ::CreateFileW(to_utf16(path).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+		if (m_dir == INVALID_HANDLE_VALUE)
+			throw windows_error(::GetLastError());
+
+		m_event = ::CreateEventW(0, TRUE, FALSE, 0);
+		if (!m_event)
+		{
+			DWORD dwError = ::GetLastError();
+			::CloseHandle(m_dir);
+			throw windows_error(dwError);
+		}
+	}
+
+	~directory_watcher()
+	{
+		::CloseHandle(m_event);
+		::CloseHandle(m_dir);
+	}
+
+	// Changes are only recorded once the first read is issued,
+	// so this must be called before any token is handed out.
+	void start()
+	{
+		memset(&m_overlapped, 0, sizeof m_overlapped);
+		m_overlapped.hEvent = m_event;
+
+		DWORD const filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME
+			| FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+		if (!::ReadDirectoryChangesW(m_dir, m_buf, sizeof m_buf, TRUE, filter, 0, &m_overlapped, 0))
+			throw windows_error(::GetLastError());
+	}
+
+	void run()
+	{
+		for (;;)
+		{
+			DWORD size;
+			if (!::GetOverlappedResult(m_dir, &m_overlapped, &size, TRUE))
+			{
+				DWORD dwError = ::GetLastError();
+				if (dwError != ERROR_NOTIFY_ENUM_DIR)
+					throw windows_error(dwError);
+				size = 0;
+			}
+
+			// An empty result means the system's buffer overflowed.
+			if (size == 0)
+				m_journal.overflow();
+			else
+				this->record(size);
+
+			this->start();
+		}
+	}
+
+private:
+	void record(DWORD size)
+	{
+		uint8_t const * p = (uint8_t const *)m_buf;
+		uint8_t const * last = p + size;
+
+		for (;;)
+		{
+			FILE_NOTIFY_INFORMATION const * fni = (FILE_NOTIFY_INFORMATION const *)p;
+
+			std::string path = from_utf16(fni->FileName, fni->FileNameLength / sizeof(wchar_t));
+			std::replace(path.begin(), path.end(), '\\', '/');
+
+			if (starts_with(path, ".git/") && fni->Action == FILE_ACTION_ADDED)
+			{
+				string_view name = string_view(path).substr(5);
+				if (starts_with(name, cookie_prefix))
+					m_journal.add_cookie(name);
+			}
+			else if (path != ".git" && !starts_with(path, ".git/"))
+			{
+				bool created = fni->Action == FILE_ACTION_ADDED || fni->Action == FILE_ACTION_RENAMED_NEW_NAME;
+				m_journal.add(std::move(path), created);
+			}
+
+			if (fni->NextEntryOffset == 0 || fni->NextEntryOffset >= (size_t)(last - p))
+				break;
+			p += fni->NextEntryOffset;
+		}
+	}
+
+	fsmonitor_journal & m_journal;
+	HANDLE m_dir;
+	HANDLE m_event;
+	OVERLAPPED m_overlapped;
+	DWORD m_buf[16*1024];
+};
+
+}
+
+void fsmonitor_run(string_view wd_path)
+{
+	std::wstring pipe_name = fsmonitor_pipe_name(wd_path);
+
+	fsmonitor_journal journal;
+	directory_watcher watcher(wd_path, journal);
+	watcher.start();
+
+	// The watcher lives until the process is terminated.
+	std::thread([&watcher] {
+		try
+		{
+			watcher.run();
+		}
+		catch (std::exception const & e)
+		{
+			fprintf(stderr, "error: fsmonitor: %s\n", e.what());
+			exit(1);
+		}
+	}).detach();
+
+	for (;;)
+	{
+		HANDLE hPipe = ::CreateNamedPipeW(pipe_name.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1, 64*1024, 64*1024, 0, 0);
+		if (hPipe == INVALID_HANDLE_VALUE)
+			throw windows_error(::GetLastError());
+
+		if (::ConnectNamedPipe(hPipe, 0) || ::GetLastError() == ERROR_PIPE_CONNECTED)
+		{
+			char buf[256];
+			DWORD read;
+			if (::ReadFile(hPipe, buf, sizeof buf, &read, 0))
+			{
+				string_view query(buf, buf + read);
+				size_t sep = query.find('\n');
+
+				std::string answer = sep == query.size()
+					? journal.answer(query, string_view())
+					: journal.answer(query.substr(0, sep), query.substr(sep + 1));
+
+				DWORD written;
+				if (::WriteFile(hPipe, answer.data(), (DWORD)answer.size(), &written, 0))
+					::FlushFileBuffers(hPipe);
+			}
+
+			::DisconnectNamedPipe(hPipe);
+		}
+
+		::CloseHandle(hPipe);
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef FSMONITOR_H
+#define FSMONITOR_H
+
+#include "string_view.h"
+#include <string>
+#include <vector>
+
+// A path changed in a working tree, relative to its root. Paths that were
+// created or renamed into place may be directories whose whole content is new.
+struct fsmonitor_change
+{
+	std::string path;
+	bool created;
+};
+
+// Asks the `gh fsmonitor` daemon watching `wd_path` what changed since `token`,
+// returns false if there is none. The daemon hands out a new token with each
+// answer. If it can't tell what changed since `token`, e.g. because its journal
+// overflowed, `complete` is set to false and the whole tree must be examined.
+// The answer includes every change made before the call; to know when the daemon
+// has caught up, a short-lived cookie file is created in `.git`.
+bool fsmonitor_query(string_view wd_path, string_view token, std::string & new_token, bool & complete, std::vector<fsmonitor_change> & changes);
+
+// Watches `wd_path` and answers queries about it until the process is terminated.
+void fsmonitor_run(string_view wd_path);
+
+#endif // FSMONITOR_H
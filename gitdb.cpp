@@ -3,95 +3,222 @@
 #include "text_reader.h"
 #include "zlib_stream.h"
 #include "sha1.h"
+#include "fsmonitor.h"
 #include "assert.h"
+#include <time.h>
 #include <memory>
 #include <map>
+#include <set>
+#include <list>
 #include <utility>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 
 static size_t get_variant(uint8_t const *& p, uint8_t const * last)
 {
 	size_t res = 0;
-	do
+	size_t shift = 0;
+	for (;;)
 	{
-		res = (res << 7) | (*p & 0x7f);
+		if (p == last || shift >= sizeof(size_t) * 8)
+			throw std::runtime_error("XXX malformed delta");
+
+		uint8_t b = *p++;
+		res |= (size_t)(b & 0x7f) << shift;
+		shift += 7;
+
+		if ((b & 0x80) == 0)
+			return res;
 	}
-	while (*p++ & 0x80 && p != last);
-	return res;
 }
 
-class patcher
-	: public istream
+// Applies a git delta to `base`. The target size is read from the delta
+// header, so `out` is sized once; its capacity is reused across calls.
+static void apply_delta(uint8_t const * base_first, uint8_t const * base_last, uint8_t const * p, uint8_t const * last, std::vector<uint8_t> & out)
 {
-public:
-	patcher(istream & base, istream & delta)
-		: m_pos(0)
-	{
-		std::vector<uint8_t> bb = read_all(base);
-		std::vector<uint8_t> dd = read_all(delta);
+	size_t base_size = base_last - base_first;
 
-		uint8_t const * p = dd.data();
-		uint8_t const * last = dd.data() + dd.size();
+	size_t src_size = get_variant(p, last);
+	size_t dst_size = get_variant(p, last);
+	if (src_size != base_size)
+		throw std::runtime_error("XXX malformed delta");
 
-#if 0
-		size_t src_size = get_variant(p, last);
-		size_t dst_size = get_variant(p, last);
-#else
-		get_variant(p, last);
-		get_variant(p, last);
-#endif
+	out.resize(dst_size);
+	uint8_t * dst = out.data();
+	uint8_t * dst_last = dst + dst_size;
 
-		while (p != last)
+	while (p != last)
+	{
+		uint8_t cmd = *p++;
+		if (cmd & 0x80)
 		{
-			uint8_t cmd = *p++;
-			if (cmd & 0x80)
-			{
-				uint32_t offs = 0;
-				uint32_t size = 0;
-
-				if (cmd & 0x01)
-					offs = *p++;
-				if (cmd & 0x02)
-					offs |= ((uint32_t)*p++ << 8);
-				if (cmd & 0x04)
-					offs |= ((uint32_t)*p++ << 16);
-				if (cmd & 0x08)
-					offs |= ((uint32_t)*p++ << 24);
-
-				if (cmd & 0x10)
-					size = *p++;
-				if (cmd & 0x20)
-					size |= ((uint32_t)*p++ << 8);
-				if (cmd & 0x40)
-					size |= ((uint32_t)*p++ << 16);
-				if (size == 0)
-					size = 0x10000;
-
-				patched.insert(patched.end(), bb.data() + offs, bb.data() + offs + size);
-			}
-			else
-			{
-				patched.insert(patched.end(), p, p + cmd);
-				p += cmd;
-			}
+			// Each of the low seven bits stands for a byte of the offset or size.
+			size_t arg_bytes = 0;
+			for (uint8_t bits = cmd & 0x7f; bits != 0; bits &= bits - 1)
+				++arg_bytes;
+			if (arg_bytes > (size_t)(last - p))
+				throw std::runtime_error("XXX malformed delta");
+
+			uint32_t offs = 0;
+			uint32_t size = 0;
+
+			if (cmd & 0x01)
+				offs = *p++;
+			if (cmd & 0x02)
+				offs |= ((uint32_t)*p++ << 8);
+			if (cmd & 0x04)
+				offs |= ((uint32_t)*p++ << 16);
+			if (cmd & 0x08)
+				offs |= ((uint32_t)*p++ << 24);
+
+			if (cmd & 0x10)
+				size = *p++;
+			if (cmd & 0x20)
+				size |= ((uint32_t)*p++ << 8);
+			if (cmd & 0x40)
+				size |= ((uint32_t)*p++ << 16);
+			if (size == 0)
+				size = 0x10000;
+
+			if (offs > base_size || size > base_size - offs || size > (size_t)(dst_last - dst))
+				throw std::runtime_error("XXX malformed delta");
+
+			dst = std::copy(base_first + offs, base_first + offs + size, dst);
+		}
+		else
+		{
+			if (cmd == 0 || cmd > last - p || cmd > dst_last - dst)
+				throw std::runtime_error("XXX malformed delta");
+
+			dst = std::copy(p, p + cmd, dst);
+			p += cmd;
 		}
 	}
 
-	size_t read(uint8_t * p, size_t capacity) override
+	if (dst != dst_last)
+		throw std::runtime_error("XXX malformed delta");
+}
+
+namespace {
+
+struct object_pack;
+
+struct cached_object
+{
+	gitdb::object_type type;
+	std::shared_ptr<std::vector<uint8_t> const> content;
+};
+
+// Keeps the contents of recently used objects, bounded by their total size.
+template <typename Key>
+class object_cache
+{
+public:
+	object_cache()
+		: m_size(0), m_limit(0), m_stats()
+	{
+	}
+
+	bool find(Key const & key, cached_object & obj)
+	{
+		bool found = this->find_uncounted(key, obj);
+		this->count(found);
+		return found;
+	}
+
+	// Like `find`, but leaves it to the caller to `count` the lookups that matter.
+	bool find_uncounted(Key const & key, cached_object & obj)
+	{
+		auto it = m_index.find(key);
+		if (it == m_index.end())
+			return false;
+
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		obj = it->second->obj;
+		return true;
+	}
+
+	void count(bool hit)
+	{
+		if (hit)
+			++m_stats.hits;
+		else
+			++m_stats.misses;
+	}
+
+	void insert(Key const & key, cached_object const & obj)
+	{
+		size_t size = obj.content->size();
+		if (size > m_limit)
+			return;
+
+		if (m_index.find(key) != m_index.end())
+			return;
+
+		this->evict(m_limit - size);
+
+		entry e;
+		e.key = key;
+		e.obj = obj;
+		m_lru.push_front(std::move(e));
+		m_index[key] = m_lru.begin();
+		m_size += size;
+	}
+
+	void set_limit(size_t limit)
 	{
-		if (capacity > patched.size() - m_pos)
-			capacity = patched.size() - m_pos;
+		m_limit = limit;
+		this->evict(limit);
+	}
 
-		std::copy(patched.begin() + m_pos, patched.begin() + m_pos + capacity, p);
-		m_pos += capacity;
-		return capacity;
+	gitdb::cache_stats stats() const
+	{
+		return m_stats;
 	}
 
 private:
-	std::vector<uint8_t> patched;
-	size_t m_pos;
+	struct entry
+	{
+		Key key;
+		cached_object obj;
+	};
+
+	// The most recently used entries are at the front.
+	std::list<entry> m_lru;
+	std::map<Key, typename std::list<entry>::iterator> m_index;
+
+	size_t m_size;
+	size_t m_limit;
+	gitdb::cache_stats m_stats;
+
+	void evict(size_t limit)
+	{
+		while (m_size > limit)
+		{
+			entry & e = m_lru.back();
+			m_size -= e.obj.content->size();
+			m_index.erase(e.key);
+			m_lru.pop_back();
+		}
+	}
 };
 
-namespace {
+// Keeps fully reconstructed delta bases, so that objects sharing
+// a base don't have to resolve the base's delta chain again.
+typedef object_cache<std::pair<object_pack const *, file_offset_t> > delta_base_cache;
+
+struct pack_entry_header
+{
+	gitdb::object_type type;
+	size_t size;
+
+	file_offset_t data_offs;
+	file_offset_t base_offs;
+};
 
 struct object_pack
 {
@@ -99,26 +226,230 @@ struct object_pack
 	file pack;
 	uint32_t fanout_table[256];
 
+	// If the files can be mapped, all reads go directly to the views.
+	file_view idx_view;
+	file_view pack_view;
+
+	uint8_t const * read_idx(file_offset_t offs, uint8_t * buf, size_t size);
+	size_t read_pack(file_offset_t offs, uint8_t * buf, size_t size, uint8_t const *& p);
+	std::shared_ptr<istream> inflate_stream(file_offset_t offs);
+
+	delta_base_cache * base_cache;
+
+	bool find_oid(object_id const & oid, size_t & pos);
+	bool find_offset(object_id const & oid, file_offset_t & offs);
+	file_offset_t offset_at(size_t pos);
+	bool read_header(file_offset_t offs, pack_entry_header & hdr);
+
 	gitdb::object get_object(object_id oid, gitdb::object_type req_type);
 	gitdb::object get_object(file_offset_t offs, gitdb::object_type req_type);
 };
 
+// Maps object names to their pack and offset for all the packs it covers,
+// so that a single lookup replaces searching each pack's index in turn.
+struct multi_pack_index
+{
+	file f;
+	file_view view;
+	uint32_t fanout_table[256];
+
+	uint8_t const * oids;
+	uint8_t const * offsets;
+	uint8_t const * large_offsets;
+	size_t large_offset_count;
+
+	std::vector<object_pack *> packs;
+
+	multi_pack_index()
+		: oids(0), offsets(0), large_offsets(0), large_offset_count(0)
+	{
+	}
+
+	bool find(object_id const & oid, object_pack *& op, file_offset_t & offs);
+};
+
+// A single commit-graph file; a split graph consists of a chain of these,
+// where each layer's positions follow those of the layers below it.
+struct commit_graph_layer
+{
+	file f;
+	file_view view;
+	uint32_t fanout_table[256];
+
+	uint8_t const * oids;
+	uint8_t const * commit_data;
+	uint8_t const * extra_edges;
+	size_t extra_edge_count;
+
+	uint32_t first_pos;
+	uint32_t count;
+
+	commit_graph_layer()
+		: oids(0), commit_data(0), extra_edges(0), extra_edge_count(0), first_pos(0), count(0)
+	{
+	}
+};
+
+// The reachability bitmaps of a single pack, `pack-*.bitmap`. Bits are
+// numbered by the order in which the objects are stored in the pack.
+struct pack_bitmap_index
+{
+	file f;
+	file_view view;
+	object_pack * pack;
+	size_t object_count;
+
+	// The index position of the object at each pack position and vice versa.
+	std::vector<uint32_t> pack_order;
+	std::vector<uint32_t> pack_positions;
+
+	// Pack offsets in pack order, followed by the offset of the pack's trailer.
+	std::vector<file_offset_t> offsets;
+
+	// Commits, trees, blobs and tags.
+	gitdb::object_bitmap type_bitmaps[4];
+
+	// Each selected commit's bitmap is stored either as is or XORed
+	// with the bitmap of one of the preceding entries.
+	struct entry
+	{
+		uint8_t const * ewah;
+		size_t xor_base;
+	};
+
+	std::vector<entry> entries;
+	std::map<uint32_t, size_t> commit_entries;
+
+	bool find_position(object_id const & oid, size_t & pos);
+	bool get_commit_bitmap(size_t pos, gitdb::object_bitmap & bitmap);
+};
+
+// An EWAH bitmap is stored as its size in bits, the number of 64-bit words,
+// the words themselves and the position of the last run-length word.
+static uint8_t const * skip_ewah(uint8_t const * p, uint8_t const * last)
+{
+	if (last - p < 8)
+		throw std::runtime_error("XXX invalid EWAH bitmap");
+
+	size_t word_count = load_be<uint32_t>(p + 4);
+	size_t rest = (size_t)(last - p) - 8;
+	if (rest / 8 < word_count || rest - 8 * word_count < 4)
+		throw std::runtime_error("XXX invalid EWAH bitmap");
+
+	return p + 8 + 8 * word_count + 4;
+}
+
+static void xor_ewah(uint8_t const * p, std::vector<uint64_t> & words)
+{
+	size_t word_count = load_be<uint32_t>(p + 4);
+	uint8_t const * w = p + 8;
+
+	// Each run-length word describes a run of all-zero or all-one words
+	// and the number of literal words that follow it.
+	size_t pos = 0;
+	for (size_t i = 0; i != word_count;)
+	{
+		uint64_t rlw = load_be<uint64_t>(w + 8 * i++);
+		size_t run_length = (size_t)((rlw >> 1) & 0xffffffff);
+		size_t literal_count = (size_t)(rlw >> 33);
+
+		if (run_length > words.size() - pos
+			|| literal_count > words.size() - pos - run_length
+			|| literal_count > word_count - i)
+		{
+			throw std::runtime_error("XXX invalid EWAH bitmap");
+		}
+
+		if (rlw & 1)
+		{
+			for (size_t j = 0; j != run_length; ++j)
+				words[pos + j] = ~words[pos + j];
+		}
+		pos += run_length;
+
+		for (size_t j = 0; j != literal_count; ++j)
+			words[pos++] ^= load_be<uint64_t>(w + 8 * i++);
+	}
+}
+
+// Small files are read whole, larger ones are mapped if possible.
+static string_view load_file(file & f, file_view & view, std::vector<uint8_t> & buf)
+{
+	file_offset_t size = f.size();
+	if (size > 64 * 1024 && view.try_map(f))
+		return string_view((char const *)view.begin(), (char const *)view.end());
+
+	buf.resize((size_t)size);
+	file::ifile fi = f.seekg(0);
+	buf.resize(read_up_to(fi, buf.data(), buf.size()));
+	return string_view((char const *)buf.data(), (char const *)buf.data() + buf.size());
+}
+
 struct loose_stream
 	: public istream
 {
-	loose_stream(file && f)
-		: m_file(std::move(f)), m_f(m_file.seekg(0)), z(m_f)
+	// If `expected_oid` is given, the object is hashed as it is inflated
+	// and the read that reaches the end throws on a mismatch. The compressed
+	// object is held in memory, so that zlib gets all of it at once.
+	loose_stream(file && f, object_id const * expected_oid)
+		: m_file(std::move(f)), m_compressed(load_file(m_file, m_view, m_buf)),
+		z((uint8_t const *)m_compressed.begin(), (uint8_t const *)m_compressed.end()), m_verify(expected_oid != 0)
 	{
+		if (expected_oid)
+			m_expected_oid = *expected_oid;
+
+		m_head_first = m_head;
+		m_head_last = m_head + read_up_to(z, m_head, sizeof m_head);
+		if (m_verify)
+			m_sha.add(m_head, m_head_last);
 	}
 
 	size_t read(uint8_t * p, size_t capacity) override
 	{
-		return z.read(p, capacity);
+		if (m_head_first != m_head_last)
+		{
+			size_t r = (std::min)(capacity, (size_t)(m_head_last - m_head_first));
+			std::copy(m_head_first, m_head_first + r, p);
+			m_head_first += r;
+			return r;
+		}
+
+		size_t r = z.read(p, capacity);
+		if (m_verify)
+		{
+			if (r != 0)
+			{
+				m_sha.add(p, p + r);
+			}
+			else
+			{
+				m_verify = false;
+
+				uint8_t hash[20];
+				m_sha.finish(hash);
+				if (object_id(hash) != m_expected_oid)
+					throw std::runtime_error("XXX loose object is corrupt");
+			}
+		}
+
+		return r;
 	}
 
 	file m_file;
-	file::ifile m_f;
+	file_view m_view;
+	std::vector<uint8_t> m_buf;
+	string_view m_compressed;
 	zlib_istream z;
+
+	// The first inflated bytes, the header is parsed from these
+	// and the rest is served before inflating any further.
+	uint8_t m_head[64];
+	uint8_t * m_head_first;
+	uint8_t * m_head_last;
+
+	bool m_verify;
+	sha1_state m_sha;
+	object_id m_expected_oid;
 };
 
 struct packed_stream
@@ -138,142 +469,391 @@ struct packed_stream
 	zlib_istream m_z;
 };
 
-struct patch_stream
+struct buffer_stream
 	: public istream
 {
-	patch_stream(std::shared_ptr<istream> base, file::ifile delta)
-		: m_base(std::move(base)), m_delta(delta), m_delta_z(m_delta), m_patcher(*m_base, m_delta_z)
+	explicit buffer_stream(std::shared_ptr<std::vector<uint8_t> const> buf)
+		: m_buf(std::move(buf)), m_s(m_buf->data(), m_buf->data() + m_buf->size())
 	{
 	}
 
 	size_t read(uint8_t * p, size_t capacity) override
 	{
-		return m_patcher.read(p, capacity);
+		return m_s.read(p, capacity);
 	}
 
-	std::shared_ptr<istream> m_base;
-	file::ifile m_delta;
-	zlib_istream m_delta_z;
-	patcher m_patcher;
+	std::shared_ptr<std::vector<uint8_t> const> m_buf;
+	mem_istream m_s;
 };
 
 }
 
-gitdb::object object_pack::get_object(object_id oid, gitdb::object_type req_type)
+uint8_t const * object_pack::read_idx(file_offset_t offs, uint8_t * buf, size_t size)
+{
+	if (idx_view.is_mapped())
+	{
+		if (offs > idx_view.size() || idx_view.size() - offs < size)
+			throw std::runtime_error("XXX truncated pack index");
+		return idx_view.data() + offs;
+	}
+
+	auto idx_r = idx.seekg(offs);
+	read_all(idx_r, buf, size);
+	return buf;
+}
+
+size_t object_pack::read_pack(file_offset_t offs, uint8_t * buf, size_t size, uint8_t const *& p)
 {
-	size_t offs0 = oid[0]? fanout_table[oid[0] - 1]: 0;
-	size_t offs1 = fanout_table[oid[0]];
+	if (pack_view.is_mapped())
+	{
+		if (offs > pack_view.size())
+			return 0;
+
+		p = pack_view.data() + offs;
+		return (std::min)(size, (size_t)(pack_view.size() - offs));
+	}
+
+	file::ifile packi = pack.seekg(offs);
+	p = buf;
+	return read_up_to(packi, buf, size);
+}
 
-	// naturally, I/O-aware binary search should happen here instead
+std::shared_ptr<istream> object_pack::inflate_stream(file_offset_t offs)
+{
+	if (pack_view.is_mapped())
+		return std::make_shared<zlib_istream>(pack_view.data() + offs, pack_view.end());
+	return std::make_shared<packed_stream>(pack.seekg(offs));
+}
 
-	auto idx_r = idx.seekg(256 * 4 + 8 + 20 * offs0);
+static uint64_t oid_bucket_key(uint8_t const * name)
+{
+	// The first byte is fixed within a fanout bucket, take the next 56 bits.
+	return load_be<uint64_t>(name + 1) >> 8;
+}
 
-	bool found = false;
-	while (!found && offs0 < offs1)
+// Searches a sorted table of object names, `name_at(i, buf)` returns
+// a pointer to the i-th name, possibly reading it into `buf`.
+template <typename NameAt>
+static bool find_oid_in_table(uint32_t const * fanout_table, object_id const & oid, NameAt name_at, size_t & pos)
+{
+	size_t lo = oid[0]? fanout_table[oid[0] - 1]: 0;
+	size_t hi = fanout_table[oid[0]];
+
+	// Object names are uniformly distributed, so we guess the position
+	// by interpolating within the key range of [lo, hi). Whenever a guess
+	// fails to halve the range, the next probe bisects instead, which keeps
+	// the worst case logarithmic.
+	uint64_t key = oid_bucket_key(oid.begin());
+	uint64_t lo_key = 0;
+	uint64_t hi_key = uint64_t(1) << 56;
+	bool bisect = false;
+
+	while (lo < hi)
 	{
-		size_t chunk = (std::min)(offs1 - offs0, size_t(1024));
+		size_t mid;
+		if (bisect || hi_key <= lo_key)
+		{
+			mid = lo + (hi - lo) / 2;
+		}
+		else
+		{
+			mid = lo + (size_t)((double)(key - lo_key) / (double)(hi_key - lo_key) * (hi - lo));
+			if (mid >= hi)
+				mid = hi - 1;
+		}
 
-		uint8_t oids[1024][20];
-		read_all(idx_r, oids[0], 20 * chunk);
+		uint8_t name_buf[20];
+		uint8_t const * name = name_at(mid, name_buf);
 
-		for (size_t i = 0; i < chunk; ++i)
+		int r = memcmp(oid.begin(), name, 20);
+		if (r == 0)
 		{
-			if (oid == oids[i])
-			{
-				offs0 += i;
-				found = true;
-				break;
-			}
+			pos = mid;
+			return true;
 		}
 
-		if (!found)
-			offs0 += chunk;
+		size_t old_size = hi - lo;
+		if (r < 0)
+		{
+			hi = mid;
+			hi_key = oid_bucket_key(name);
+		}
+		else
+		{
+			lo = mid + 1;
+			lo_key = oid_bucket_key(name);
+		}
+
+		bisect = !bisect && hi - lo > old_size / 2;
 	}
 
+	return false;
+}
+
+bool object_pack::find_oid(object_id const & oid, size_t & pos)
+{
+	return find_oid_in_table(fanout_table, oid, [this](size_t i, uint8_t * buf) {
+		return this->read_idx(8 + 256 * 4 + 20 * (file_offset_t)i, buf, 20);
+	}, pos);
+}
+
+bool multi_pack_index::find(object_id const & oid, object_pack *& op, file_offset_t & offs)
+{
+	size_t pos;
+	bool found = find_oid_in_table(fanout_table, oid, [this](size_t i, uint8_t *) {
+		return oids + 20 * i;
+	}, pos);
+
 	if (!found)
-		return gitdb::object();
+		return false;
 
-	idx_r = idx.seekg(8 + 256 * 4 + fanout_table[0xff] * 24 + 4 * offs0);
+	uint8_t const * entry = offsets + 8 * pos;
 
-	uint8_t offs_buf[4];
-	read_all(idx_r, offs_buf, sizeof offs_buf);
+	uint32_t pack_id = load_be<uint32_t>(entry);
+	if (pack_id >= packs.size())
+		throw std::runtime_error("XXX invalid multi-pack-index");
+	op = packs[pack_id];
 
-	file_offset_t offs = load_be<uint32_t>(offs_buf);
+	offs = load_be<uint32_t>(entry + 4);
 	if (offs & 0x80000000)
 	{
-		// XXX: todo
-		assert(0);
+		file_offset_t large_pos = offs & 0x7fffffff;
+		if (large_pos >= large_offset_count)
+			throw std::runtime_error("XXX invalid multi-pack-index");
+		offs = load_be<uint64_t>(large_offsets + 8 * large_pos);
 	}
 
-	return this->get_object(offs, req_type);
+	return true;
 }
 
-gitdb::object object_pack::get_object(file_offset_t offs, gitdb::object_type req_type)
+bool object_pack::find_offset(object_id const & oid, file_offset_t & offs)
 {
-	uint8_t buf[64];
+	size_t pos;
+	if (!this->find_oid(oid, pos))
+		return false;
 
-	file::ifile packi = pack.seekg(offs);
-	read_up_to(packi, buf, sizeof buf);
+	offs = this->offset_at(pos);
+	return true;
+}
+
+file_offset_t object_pack::offset_at(size_t pos)
+{
+	file_offset_t object_count = fanout_table[0xff];
+
+	uint8_t offs_buf[8];
+	file_offset_t offs = load_be<uint32_t>(this->read_idx(8 + 256 * 4 + object_count * 24 + 4 * (file_offset_t)pos, offs_buf, 4));
+	if (offs & 0x80000000)
+	{
+		// Packs larger than 2 GiB store the offsets that don't fit into 31 bits
+		// in a separate table of 64-bit entries following the 32-bit ones.
+		file_offset_t large_pos = offs & 0x7fffffff;
+		offs = load_be<uint64_t>(this->read_idx(8 + 256 * 4 + object_count * 28 + 8 * large_pos, offs_buf, 8));
+	}
 
-	uint8_t * p = buf;
-	gitdb::object_type type = static_cast<gitdb::object_type>((buf[0] >> 4) & 7);
-	uint32_t size = buf[0] & 15;
+	return offs;
+}
+
+bool pack_bitmap_index::find_position(object_id const & oid, size_t & pos)
+{
+	size_t idx_pos;
+	if (!pack->find_oid(oid, idx_pos))
+		return false;
+
+	pos = pack_positions[idx_pos];
+	return true;
+}
+
+bool pack_bitmap_index::get_commit_bitmap(size_t pos, gitdb::object_bitmap & bitmap)
+{
+	auto it = commit_entries.find((uint32_t)pos);
+	if (it == commit_entries.end())
+		return false;
+
+	// XOR is associative, so the chain of bases can be applied in any order.
+	std::vector<uint64_t> words((object_count + 63) / 64);
+	for (size_t i = it->second;; i = entries[i].xor_base)
+	{
+		xor_ewah(entries[i].ewah, words);
+		if (entries[i].xor_base == i)
+			break;
+	}
+
+	bitmap = gitdb::object_bitmap(object_count, std::move(words));
+	return true;
+}
+
+gitdb::object object_pack::get_object(object_id oid, gitdb::object_type req_type)
+{
+	file_offset_t offs;
+	if (!this->find_offset(oid, offs))
+		return gitdb::object();
+
+	return this->get_object(offs, req_type);
+}
+
+bool object_pack::read_header(file_offset_t offs, pack_entry_header & hdr)
+{
+	uint8_t hdr_buf[64];
+	uint8_t const * buf;
+	size_t len = this->read_pack(offs, hdr_buf, sizeof hdr_buf, buf);
+	if (len == 0)
+		throw std::runtime_error("XXX truncated pack");
+
+	// Only the bytes `read_pack` returned are parsed.
+	uint8_t const * p = buf;
+	uint8_t const * last = buf + len;
+
+	hdr.type = static_cast<gitdb::object_type>((buf[0] >> 4) & 7);
+	hdr.size = buf[0] & 15;
 	size_t shift = 4;
 
 	while (*p++ & 0x80)
 	{
-		size |= (*p & 0x7f) << shift;
+		if (p == last || shift >= sizeof(size_t) * 8)
+			throw std::runtime_error("XXX invalid pack entry header");
+		hdr.size |= (size_t)(*p & 0x7f) << shift;
 		shift += 7;
 	}
 
-	if (type == gitdb::object_type::ofs_delta)
+	if (hdr.type == gitdb::object_type::ofs_delta)
 	{
-		uint32_t neg_offset = *p & 0x7f;
+		if (p == last)
+			throw std::runtime_error("XXX invalid pack entry header");
+
+		file_offset_t neg_offset = *p & 0x7f;
 		while (*p++ & 0x80)
+		{
+			if (p == last || neg_offset >= ((file_offset_t)1 << (sizeof(file_offset_t) * 8 - 8)))
+				throw std::runtime_error("XXX invalid delta base offset");
 			neg_offset = ((neg_offset + 1) << 7) | (*p & 0x7f);
+		}
 
-		gitdb::object base_obj = this->get_object(offs - neg_offset, req_type);
-		if (!base_obj.content)
-			return gitdb::object();
-
-		gitdb::object obj;
-		obj.content = std::make_shared<patch_stream>(std::move(base_obj.content), pack.seekg(offs + (p - buf)));
-		obj.size = size;
-		obj.type = base_obj.type;
-		return obj;
+		if (neg_offset == 0 || neg_offset > offs)
+			throw std::runtime_error("XXX invalid delta base offset");
+		hdr.base_offs = offs - neg_offset;
 	}
-	else if (type == gitdb::object_type::ref_delta)
+	else if (hdr.type == gitdb::object_type::ref_delta)
 	{
+		if (last - p < 20)
+			throw std::runtime_error("XXX invalid pack entry header");
+
 		object_id base_oid(p);
-		gitdb::object base_obj = this->get_object(base_oid, req_type);
-		if (!base_obj.content)
-			return gitdb::object();
+		p += 20;
+		if (!this->find_offset(base_oid, hdr.base_offs))
+			return false;
+	}
 
-		gitdb::object obj;
-		obj.content = std::make_shared<patch_stream>(std::move(base_obj.content), pack.seekg(offs + (p + 20 - buf)));
-		obj.size = size;
-		obj.type = base_obj.type;
-		return obj;
+	hdr.data_offs = offs + (p - buf);
+	return true;
+}
 
-	}
-	else
+gitdb::object object_pack::get_object(file_offset_t offs, gitdb::object_type req_type)
+{
+	// Walk the delta chain down to a cached or an undeltified base,
+	// remembering each delta on the way. Nothing is inflated yet.
+	std::vector<pack_entry_header> chain;
+	cached_object base;
+
+	// Only objects that are deltas count towards the cache's statistics,
+	// as a hit if any base in their chain was cached, otherwise as a miss.
+	for (file_offset_t cur = offs;;)
 	{
-		if (req_type != gitdb::object_type::none && type != req_type)
+		if (base_cache->find_uncounted(std::make_pair(this, cur), base))
+		{
+			if (!chain.empty())
+				base_cache->count(true);
+			break;
+		}
+
+		pack_entry_header hdr;
+		if (!this->read_header(cur, hdr))
 			return gitdb::object();
 
+		if (hdr.type != gitdb::object_type::ofs_delta && hdr.type != gitdb::object_type::ref_delta)
+		{
+			if (!chain.empty())
+				base_cache->count(false);
+
+			if (req_type != gitdb::object_type::none && hdr.type != req_type)
+				return gitdb::object();
+
+			if (chain.empty())
+			{
+				gitdb::object obj;
+				obj.content = this->inflate_stream(hdr.data_offs);
+				obj.size = hdr.size;
+				obj.type = hdr.type;
+				return obj;
+			}
+
+			std::vector<uint8_t> content(hdr.size);
+			read_all(*this->inflate_stream(hdr.data_offs), content.data(), content.size());
+
+			base.type = hdr.type;
+			base.content = std::make_shared<std::vector<uint8_t> const>(std::move(content));
+			base_cache->insert(std::make_pair(this, cur), base);
+			break;
+		}
+
+		chain.push_back(hdr);
+		cur = hdr.base_offs;
+	}
+
+	if (req_type != gitdb::object_type::none && base.type != req_type)
+		return gitdb::object();
+
+	if (chain.empty())
+	{
 		gitdb::object obj;
-		obj.content = std::make_shared<packed_stream>(pack.seekg(offs + (p - buf)));
-		obj.size = size;
-		obj.type = type;
+		obj.content = std::make_shared<buffer_stream>(base.content);
+		obj.size = base.content->size();
+		obj.type = base.type;
 		return obj;
 	}
-}
 
-struct gitdb::impl
-{
-	std::string m_path;
+	// Apply the deltas from the base upwards, ping-ponging between two buffers.
+	std::vector<uint8_t> bufs[2];
+	std::vector<uint8_t> delta;
 
-	struct ref_cache_line
+	uint8_t const * src_first = base.content->data();
+	uint8_t const * src_last = src_first + base.content->size();
+
+	for (size_t i = chain.size(); i != 0; --i)
+	{
+		pack_entry_header const & hdr = chain[i - 1];
+
+		delta.resize(hdr.size);
+		read_all(*this->inflate_stream(hdr.data_offs), delta.data(), delta.size());
+
+		if (i == 1 && chain.size() > 1)
+		{
+			// The source of the last delta won't be overwritten anymore,
+			// keep it as a base for its siblings. Moving doesn't invalidate `src_first`.
+			cached_object immediate_base;
+			immediate_base.type = base.type;
+			immediate_base.content = std::make_shared<std::vector<uint8_t> const>(std::move(bufs[0]));
+			base_cache->insert(std::make_pair(this, chain[0].base_offs), immediate_base);
+		}
+
+		std::vector<uint8_t> & dst = bufs[i % 2];
+		apply_delta(src_first, src_last, delta.data(), delta.data() + delta.size(), dst);
+
+		src_first = dst.data();
+		src_last = dst.data() + dst.size();
+	}
+
+	gitdb::object obj;
+	obj.size = bufs[1].size();
+	obj.type = base.type;
+	obj.content = std::make_shared<buffer_stream>(std::make_shared<std::vector<uint8_t> const>(std::move(bufs[1])));
+	return obj;
+}
+
+struct gitdb::impl
+{
+	std::string m_path;
+
+	struct ref_cache_line
 	{
 		std::string real_ref;
 		object_id oid;
@@ -286,21 +866,90 @@ struct gitdb::impl
 
 	std::map<std::string, object_pack> m_packs;
 	bool m_packs_loaded;
+	void load_packs();
 	void load_pack(string_view path);
+
+	std::unique_ptr<multi_pack_index> m_midx;
+	std::vector<object_pack *> m_unindexed_packs;
+	void load_multi_pack_index();
+
+	std::vector<std::unique_ptr<commit_graph_layer> > m_commit_graph;
+	bool m_commit_graph_loaded;
+	void load_commit_graph();
+	bool load_commit_graph_layer(string_view path);
+	void read_commit_graph_entry(commit_graph_layer const & layer, uint32_t local_pos, commit_graph_entry & entry);
+
+	std::unique_ptr<pack_bitmap_index> m_bitmap;
+	bool m_bitmap_loaded;
+	void load_bitmap_index();
+	bool read_bitmap_index(string_view path, object_pack & op, pack_bitmap_index & bi);
+
+	delta_base_cache m_delta_base_cache;
+	object_cache<object_id> m_tree_cache;
+
+	verify_policy m_verify_policy;
+	size_t m_loose_reads;
+
+	// Loose objects present in each fan-out directory `objects/xx`,
+	// listed lazily when an object from the directory is first requested.
+	struct loose_dir
+	{
+		bool exists;
+		bool listed;
+		uint32_t mtime;
+		uint32_t listed_at;
+		std::vector<object_id> oids;
+
+		loose_dir()
+			: exists(false), listed(false), mtime(0), listed_at(0)
+		{
+		}
+	};
+
+	std::vector<loose_dir> m_loose_dirs;
+	void refresh_loose_dirs();
+	bool is_loose(object_id const & oid);
+
+	bool get_loose_object(object_id const & oid, object & obj);
+	bool get_packed_object(object_id const & oid, object & obj);
+	bool has_packed_object(object_id const & oid);
 };
 
+// With `verify_policy::sampled`, every n-th loose object read is verified.
+static size_t const verify_sample_rate = 16;
+
+void gitdb::impl::load_packs()
+{
+	if (m_packs_loaded)
+		return;
+
+	for (auto && de: enumdir(m_path + "/objects/pack", "*.idx"))
+		this->load_pack(m_path + "/objects/pack/" + de.name.substr(0, de.name.size() - 4));
+
+	for (auto && kv: m_packs)
+		m_unindexed_packs.push_back(&kv.second);
+	this->load_multi_pack_index();
+
+	m_packs_loaded = true;
+}
+
 void gitdb::impl::load_pack(string_view path)
 {
 	object_pack & op = m_packs[path.to_string()];
+	op.base_cache = &m_delta_base_cache;
 	if (!op.idx.try_open(path.to_string() + ".idx", /*readonly=*/true) || !op.pack.try_open(path.to_string() + ".pack", /*readonly=*/true))
 	{
 		m_packs.erase(path.to_string());
 		return;
 	}
 
-	uint8_t header[8 + 256 * 4];
-	file::ifile idxi = op.idx.seekg(0);
-	read_all(idxi, header, sizeof header);
+	// Mapping may fail (e.g. for a huge pack in a 32-bit process),
+	// we'll fall back to positioned reads in that case.
+	op.idx_view.try_map(op.idx);
+	op.pack_view.try_map(op.pack);
+
+	uint8_t header_buf[8 + 256 * 4];
+	uint8_t const * header = op.read_idx(0, header_buf, sizeof header_buf);
 
 	if (header[0] != 0xff || header[1] != 't' || header[2] != 'O' || header[3] != 'c')
 		throw std::runtime_error("invalid pack");
@@ -317,6 +966,352 @@ void gitdb::impl::load_pack(string_view path)
 	}
 }
 
+// The multi-pack-index and the commit-graph files share the chunk format:
+// the header is followed by a table of (id, offset) pairs, terminated
+// by an entry holding the end offset of the last chunk.
+static bool find_chunk(file_view const & view, size_t table_offs, size_t chunk_count, uint32_t id, uint8_t const *& chunk, size_t & size)
+{
+	if (view.size() < table_offs || (view.size() - table_offs) / 12 < chunk_count + 1)
+		throw std::runtime_error("XXX invalid chunk table");
+
+	uint8_t const * entry = view.data() + table_offs;
+	for (size_t i = 0; i != chunk_count; ++i, entry += 12)
+	{
+		if (load_be<uint32_t>(entry) != id)
+			continue;
+
+		uint64_t chunk_start = load_be<uint64_t>(entry + 4);
+		uint64_t chunk_end = load_be<uint64_t>(entry + 16);
+		if (chunk_start > chunk_end || chunk_end > view.size())
+			throw std::runtime_error("XXX invalid chunk table");
+
+		chunk = view.data() + chunk_start;
+		size = (size_t)(chunk_end - chunk_start);
+		return true;
+	}
+
+	return false;
+}
+
+void gitdb::impl::load_multi_pack_index()
+{
+	std::unique_ptr<multi_pack_index> midx(new multi_pack_index());
+
+	// The index is only an accelerator, we search the packs one by one
+	// if it's missing, can't be mapped or is of a version we don't know.
+	if (!midx->f.try_open(m_path + "/objects/pack/multi-pack-index", /*readonly=*/true) || !midx->view.try_map(midx->f))
+		return;
+
+	uint8_t const * first = midx->view.begin();
+
+	if (midx->view.size() < 12 || first[0] != 'M' || first[1] != 'I' || first[2] != 'D' || first[3] != 'X')
+		throw std::runtime_error("XXX invalid multi-pack-index");
+
+	// Version 1 or 2, SHA-1 names and no incremental base files.
+	if ((first[4] != 1 && first[4] != 2) || first[5] != 1 || first[7] != 0)
+		return;
+
+	size_t chunk_count = first[6];
+	size_t pack_count = load_be<uint32_t>(first + 8);
+
+	uint8_t const * pack_names;
+	size_t pack_names_size;
+	uint8_t const * fanout;
+	size_t fanout_size;
+	size_t oids_size;
+	size_t offsets_size;
+	size_t large_offsets_size;
+
+	if (!find_chunk(midx->view, 12, chunk_count, 0x504e414d /*PNAM*/, pack_names, pack_names_size)
+		|| !find_chunk(midx->view, 12, chunk_count, 0x4f494446 /*OIDF*/, fanout, fanout_size)
+		|| !find_chunk(midx->view, 12, chunk_count, 0x4f49444c /*OIDL*/, midx->oids, oids_size)
+		|| !find_chunk(midx->view, 12, chunk_count, 0x4f4f4646 /*OOFF*/, midx->offsets, offsets_size)
+		|| fanout_size != 256 * 4)
+	{
+		throw std::runtime_error("XXX invalid multi-pack-index");
+	}
+
+	if (!find_chunk(midx->view, 12, chunk_count, 0x4c4f4646 /*LOFF*/, midx->large_offsets, large_offsets_size))
+		large_offsets_size = 0;
+
+	for (size_t i = 0; i < 256; ++i)
+		midx->fanout_table[i] = load_be<uint32_t>(fanout + 4 * i);
+
+	size_t object_count = midx->fanout_table[0xff];
+	if (oids_size != 20 * object_count || offsets_size != 8 * object_count)
+		throw std::runtime_error("XXX invalid multi-pack-index");
+	midx->large_offset_count = large_offsets_size / 8;
+
+	// Pack names are NUL-terminated `pack-*.idx` names, in pack id order.
+	uint8_t const * name = pack_names;
+	uint8_t const * pack_names_last = pack_names + pack_names_size;
+	for (size_t i = 0; i != pack_count; ++i)
+	{
+		uint8_t const * name_end = std::find(name, pack_names_last, 0);
+		string_view idx_name((char const *)name, (char const *)name_end);
+		if (name_end == pack_names_last || !ends_with(idx_name, ".idx"))
+			throw std::runtime_error("XXX invalid multi-pack-index");
+
+		// A pack we don't have means the index is stale, ignore it.
+		auto it = m_packs.find(m_path + "/objects/pack/" + idx_name.trim_right(4));
+		if (it == m_packs.end())
+			return;
+
+		midx->packs.push_back(&it->second);
+		name = name_end + 1;
+	}
+
+	m_unindexed_packs.clear();
+	for (auto && kv: m_packs)
+	{
+		if (std::find(midx->packs.begin(), midx->packs.end(), &kv.second) == midx->packs.end())
+			m_unindexed_packs.push_back(&kv.second);
+	}
+
+	m_midx = std::move(midx);
+}
+
+void gitdb::impl::load_commit_graph()
+{
+	m_commit_graph_loaded = true;
+
+	file fchain;
+	if (!fchain.try_open(m_path + "/objects/info/commit-graphs/commit-graph-chain", /*readonly=*/true))
+	{
+		this->load_commit_graph_layer(m_path + "/objects/info/commit-graph");
+		return;
+	}
+
+	// The chain lists the layers' hashes starting from the base. If any
+	// of them can't be loaded, the positions in the layers above would
+	// be meaningless, so we don't use the graph at all.
+	file::ifile fi = fchain.seekg(0);
+	stream_reader sr(fi);
+
+	std::string line;
+	while (sr.read_line(line))
+	{
+		if (!this->load_commit_graph_layer(m_path + "/objects/info/commit-graphs/graph-" + line + ".graph"))
+		{
+			m_commit_graph.clear();
+			return;
+		}
+	}
+}
+
+bool gitdb::impl::load_commit_graph_layer(string_view path)
+{
+	std::unique_ptr<commit_graph_layer> layer(new commit_graph_layer());
+	if (!layer->f.try_open(path, /*readonly=*/true) || !layer->view.try_map(layer->f))
+		return false;
+
+	uint8_t const * first = layer->view.begin();
+	if (layer->view.size() < 8 || first[0] != 'C' || first[1] != 'G' || first[2] != 'P' || first[3] != 'H')
+		throw std::runtime_error("XXX invalid commit-graph");
+
+	// Version 1 with SHA-1 names, and the number of base layers must match our position in the chain.
+	if (first[4] != 1 || first[5] != 1 || first[7] != m_commit_graph.size())
+		return false;
+
+	size_t chunk_count = first[6];
+
+	uint8_t const * fanout;
+	size_t fanout_size;
+	size_t oids_size;
+	size_t commit_data_size;
+	size_t extra_edges_size;
+
+	if (!find_chunk(layer->view, 8, chunk_count, 0x4f494446 /*OIDF*/, fanout, fanout_size)
+		|| !find_chunk(layer->view, 8, chunk_count, 0x4f49444c /*OIDL*/, layer->oids, oids_size)
+		|| !find_chunk(layer->view, 8, chunk_count, 0x43444154 /*CDAT*/, layer->commit_data, commit_data_size)
+		|| fanout_size != 256 * 4)
+	{
+		throw std::runtime_error("XXX invalid commit-graph");
+	}
+
+	if (!find_chunk(layer->view, 8, chunk_count, 0x45444745 /*EDGE*/, layer->extra_edges, extra_edges_size))
+		extra_edges_size = 0;
+	layer->extra_edge_count = extra_edges_size / 4;
+
+	for (size_t i = 0; i < 256; ++i)
+		layer->fanout_table[i] = load_be<uint32_t>(fanout + 4 * i);
+
+	layer->count = layer->fanout_table[0xff];
+	if (oids_size != 20 * (size_t)layer->count || commit_data_size != 36 * (size_t)layer->count)
+		throw std::runtime_error("XXX invalid commit-graph");
+
+	if (!m_commit_graph.empty())
+		layer->first_pos = m_commit_graph.back()->first_pos + m_commit_graph.back()->count;
+
+	m_commit_graph.push_back(std::move(layer));
+	return true;
+}
+
+void gitdb::impl::read_commit_graph_entry(commit_graph_layer const & layer, uint32_t local_pos, commit_graph_entry & entry)
+{
+	static uint32_t const no_parent = 0x70000000;
+
+	uint8_t const * p = layer.commit_data + 36 * (size_t)local_pos;
+
+	entry.pos = layer.first_pos + local_pos;
+	entry.oid = object_id(layer.oids + 20 * (size_t)local_pos);
+	entry.tree_oid = object_id(p);
+
+	entry.parent_positions.clear();
+
+	uint32_t parent1 = load_be<uint32_t>(p + 20);
+	if (parent1 != no_parent)
+		entry.parent_positions.push_back(parent1);
+
+	// Octopus merges keep their second and further parents in the EDGE chunk,
+	// the last one is marked by the top bit.
+	uint32_t parent2 = load_be<uint32_t>(p + 24);
+	if (parent2 & 0x80000000)
+	{
+		for (size_t i = parent2 & 0x7fffffff;; ++i)
+		{
+			if (i >= layer.extra_edge_count)
+				throw std::runtime_error("XXX invalid commit-graph");
+
+			uint32_t edge = load_be<uint32_t>(layer.extra_edges + 4 * i);
+			entry.parent_positions.push_back(edge & 0x7fffffff);
+			if (edge & 0x80000000)
+				break;
+		}
+	}
+	else if (parent2 != no_parent)
+	{
+		entry.parent_positions.push_back(parent2);
+	}
+
+	uint32_t gen_time_hi = load_be<uint32_t>(p + 28);
+	entry.generation = gen_time_hi >> 2;
+	entry.commit_time = ((uint64_t)(gen_time_hi & 3) << 32) | load_be<uint32_t>(p + 32);
+}
+
+void gitdb::impl::load_bitmap_index()
+{
+	m_bitmap_loaded = true;
+	this->load_packs();
+
+	// Only one pack is expected to have bitmaps, the one written by a full repack.
+	for (auto && kv: m_packs)
+	{
+		std::unique_ptr<pack_bitmap_index> bi(new pack_bitmap_index());
+		if (!bi->f.try_open(kv.first + ".bitmap", /*readonly=*/true) || !bi->view.try_map(bi->f))
+			continue;
+
+		if (this->read_bitmap_index(kv.first, kv.second, *bi))
+		{
+			m_bitmap = std::move(bi);
+			return;
+		}
+	}
+}
+
+bool gitdb::impl::read_bitmap_index(string_view path, object_pack & op, pack_bitmap_index & bi)
+{
+	uint8_t const * p = bi.view.begin();
+	if (bi.view.size() < 32 + 20 || p[0] != 'B' || p[1] != 'I' || p[2] != 'T' || p[3] != 'M')
+		throw std::runtime_error("XXX invalid pack bitmap");
+
+	if (load_be<uint16_t>(p + 4) != 1)
+		return false;
+
+	// Bitmaps left over from before the pack was rewritten are useless.
+	uint8_t checksum_buf[20];
+	uint8_t const * checksum = op.read_idx(op.idx.size() - 40, checksum_buf, 20);
+	if (!std::equal(checksum, checksum + 20, p + 12))
+		return false;
+
+	size_t n = op.fanout_table[0xff];
+	bi.pack = &op;
+	bi.object_count = n;
+
+	std::vector<file_offset_t> idx_offsets(n);
+	for (size_t i = 0; i != n; ++i)
+		idx_offsets[i] = op.offset_at(i);
+
+	// The reverse index lists the objects in pack order, if there isn't
+	// one, we find the order by sorting the offsets ourselves.
+	bi.pack_order.resize(n);
+
+	file frev;
+	file_view rev_view;
+	uint8_t const * rev = 0;
+	if (frev.try_open(path.to_string() + ".rev", /*readonly=*/true) && rev_view.try_map(frev))
+	{
+		rev = rev_view.begin();
+		if (rev_view.size() < 12 + 4 * (file_offset_t)n || rev[0] != 'R' || rev[1] != 'I' || rev[2] != 'D' || rev[3] != 'X'
+			|| load_be<uint32_t>(rev + 4) != 1 || load_be<uint32_t>(rev + 8) != 1)
+		{
+			rev = 0;
+		}
+	}
+
+	if (rev)
+	{
+		for (size_t i = 0; i != n; ++i)
+		{
+			bi.pack_order[i] = load_be<uint32_t>(rev + 12 + 4 * i);
+			if (bi.pack_order[i] >= n)
+				throw std::runtime_error("XXX invalid pack reverse index");
+		}
+	}
+	else
+	{
+		for (size_t i = 0; i != n; ++i)
+			bi.pack_order[i] = (uint32_t)i;
+
+		std::sort(bi.pack_order.begin(), bi.pack_order.end(), [&idx_offsets](uint32_t lhs, uint32_t rhs) {
+			return idx_offsets[lhs] < idx_offsets[rhs];
+		});
+	}
+
+	bi.pack_positions.resize(n);
+	bi.offsets.resize(n + 1);
+	for (size_t i = 0; i != n; ++i)
+	{
+		bi.pack_positions[bi.pack_order[i]] = (uint32_t)i;
+		bi.offsets[i] = idx_offsets[bi.pack_order[i]];
+	}
+	bi.offsets[n] = op.pack.size() - 20;
+
+	size_t entry_count = load_be<uint32_t>(p + 8);
+	p += 32;
+
+	for (auto && tb: bi.type_bitmaps)
+	{
+		uint8_t const * next = skip_ewah(p, bi.view.end() - 20);
+
+		std::vector<uint64_t> words((n + 63) / 64);
+		xor_ewah(p, words);
+		tb = object_bitmap(n, std::move(words));
+		p = next;
+	}
+
+	for (size_t i = 0; i != entry_count; ++i)
+	{
+		if (bi.view.end() - 20 - p < 6)
+			throw std::runtime_error("XXX invalid pack bitmap");
+
+		uint32_t idx_pos = load_be<uint32_t>(p);
+		uint8_t xor_offset = p[4];
+		if (idx_pos >= n || xor_offset > i)
+			throw std::runtime_error("XXX invalid pack bitmap");
+
+		pack_bitmap_index::entry e;
+		e.ewah = p + 6;
+		e.xor_base = i - xor_offset;
+		p = skip_ewah(e.ewah, bi.view.end() - 20);
+
+		bi.entries.push_back(e);
+		bi.commit_entries[bi.pack_positions[idx_pos]] = i;
+	}
+
+	return true;
+}
+
 void gitdb::impl::load_packed_refs()
 {
 	file fin;
@@ -359,6 +1354,12 @@ void gitdb::open(string_view path)
 	pimpl->m_path = path;
 	pimpl->m_packed_refs_loaded = false;
 	pimpl->m_packs_loaded = false;
+	pimpl->m_commit_graph_loaded = false;
+	pimpl->m_bitmap_loaded = false;
+	pimpl->m_delta_base_cache.set_limit(96 * 1024 * 1024);
+	pimpl->m_tree_cache.set_limit(32 * 1024 * 1024);
+	pimpl->m_verify_policy = verify_policy::never;
+	pimpl->m_loose_reads = 0;
 	m_pimpl = pimpl.release();
 }
 
@@ -372,6 +1373,21 @@ void gitdb::create(string_view path)
 	file::create(path.to_string() + "/HEAD", "ref: refs/heads/master\n");
 }
 
+void gitdb::set_delta_base_cache_limit(size_t limit)
+{
+	m_pimpl->m_delta_base_cache.set_limit(limit);
+}
+
+gitdb::cache_stats gitdb::delta_base_cache_stats() const
+{
+	return m_pimpl->m_delta_base_cache.stats();
+}
+
+void gitdb::set_verify_policy(verify_policy policy)
+{
+	m_pimpl->m_verify_policy = policy;
+}
+
 gitdb::gitdb(gitdb && o)
 	: m_pimpl(o.m_pimpl)
 {
@@ -391,10 +1407,20 @@ gitdb & gitdb::operator=(gitdb && o)
 
 std::vector<uint8_t> gitdb::get_object_content(object_id oid, object_type type)
 {
-	std::shared_ptr<istream> ss = this->get_object_stream(oid, type);
-	if (!ss)
+	object obj = this->get_object(oid);
+	if (!obj.content || obj.type != type)
 		throw std::runtime_error("XXX oid not found");
-	return read_all(*ss);
+
+	// The size is known, so the content is inflated straight into place,
+	// with a single call to zlib for objects in a mapped pack.
+	std::vector<uint8_t> res(obj.size);
+	read_all(*obj.content, res.data(), res.size());
+
+	// Reaching the end is what has verified loose objects checked.
+	uint8_t extra;
+	if (obj.content->read(&extra, 1) != 0)
+		throw std::runtime_error("XXX object is larger than its header says");
+	return res;
 }
 
 std::shared_ptr<istream> gitdb::get_object_stream(object_id oid, object_type req_type)
@@ -405,71 +1431,206 @@ std::shared_ptr<istream> gitdb::get_object_stream(object_id oid, object_type req
 	return obj.content;
 }
 
-gitdb::object gitdb::get_object(object_id oid)
+static bool parse_hex_byte(char const * p, uint8_t & res)
 {
-	std::string s = oid.base16();
-	file f;
+	res = 0;
+	for (size_t i = 0; i != 2; ++i)
+	{
+		char ch = p[i];
+		if ('0' <= ch && ch <= '9')
+			res = (res << 4) | (ch - '0');
+		else if ('a' <= ch && ch <= 'f')
+			res = (res << 4) | (ch - 'a' + 10);
+		else
+			return false;
+	}
+	return true;
+}
 
-	if (!f.try_open(m_pimpl->m_path + "/objects/" + s.substr(0, 2) + "/" + s.substr(2), /*readonly=*/true))
+void gitdb::impl::refresh_loose_dirs()
+{
+	bool first = m_loose_dirs.empty();
+	if (first)
+		m_loose_dirs.resize(256);
+
+	std::vector<bool> seen(256);
+	for (directory_entry const & de: listdir(m_path + "/objects"))
+	{
+		uint8_t idx;
+		if (de.type() != dir_entry_type::directory || de.name.size() != 2 || !parse_hex_byte(de.name.data(), idx))
+			continue;
+
+		// Directory mtimes only have a resolution of a second, so a listing
+		// taken during the same second as the last change can't be trusted.
+		loose_dir & ld = m_loose_dirs[idx];
+		if (ld.listed && (ld.mtime != de.mtime || ld.mtime >= ld.listed_at))
+			ld.listed = false;
+
+		ld.exists = true;
+		ld.mtime = de.mtime;
+		seen[idx] = true;
+	}
+
+	for (size_t i = 0; i != 256; ++i)
 	{
-		if (!m_pimpl->m_packs_loaded)
+		if (!seen[i])
 		{
-			for (auto && de: enumdir(m_pimpl->m_path + "/objects/pack", "*.idx"))
-				m_pimpl->load_pack(m_pimpl->m_path + "/objects/pack/" + de.name.substr(0, de.name.size() - 4));
-			m_pimpl->m_packs_loaded = true;
+			m_loose_dirs[i].exists = false;
+			m_loose_dirs[i].listed = false;
+			m_loose_dirs[i].oids.clear();
 		}
+	}
+}
+
+bool gitdb::impl::is_loose(object_id const & oid)
+{
+	if (m_loose_dirs.empty())
+		this->refresh_loose_dirs();
 
-		for (auto && kv: m_pimpl->m_packs)
+	loose_dir & ld = m_loose_dirs[oid[0]];
+	if (!ld.exists)
+		return false;
+
+	if (!ld.listed)
+	{
+		std::string dir_name = oid.base16().substr(0, 2);
+
+		ld.oids.clear();
+		ld.listed_at = (uint32_t)time(0);
+		for (directory_entry const & de: listdir(m_path + "/objects/" + dir_name))
 		{
-			gitdb::object os = kv.second.get_object(oid, object_type::none);
-			if (os.content)
-				return os;
+			if (de.name.size() != 38)
+				continue;
+
+			std::string name = dir_name + de.name;
+
+			uint8_t b;
+			bool valid = true;
+			for (size_t i = 0; valid && i != 40; i += 2)
+				valid = parse_hex_byte(name.data() + i, b);
+
+			if (valid)
+				ld.oids.push_back(object_id(name));
 		}
 
-		return object();
+		std::sort(ld.oids.begin(), ld.oids.end());
+		ld.listed = true;
 	}
 
+	return std::binary_search(ld.oids.begin(), ld.oids.end(), oid);
+}
+
+bool gitdb::impl::get_packed_object(object_id const & oid, object & obj)
+{
+	this->load_packs();
+
+	object_pack * op;
+	file_offset_t offs;
+	if (m_midx && m_midx->find(oid, op, offs))
 	{
-		file::ifile fi(f.seekg(0));
-		zlib_istream z(fi);
-		object_id oid = sha1(z);
-		oid.base16();
+		obj = op->get_object(offs, object_type::none);
+		if (obj.content)
+			return true;
 	}
 
-	object obj;
-	size_t nul_pos;
+	for (object_pack * op: m_unindexed_packs)
 	{
-		file::ifile fi(f.seekg(0));
-		zlib_istream z(fi);
-
-		uint8_t buf[64];
-		size_t r = read_up_to(z, buf, 64);
-		nul_pos = std::find(buf, buf + r, 0) - buf;
-		if (nul_pos == r)
-			throw std::runtime_error("XXX invalid header");
-
-		r = std::find(buf, buf + nul_pos, ' ') - buf;
-		if (r == nul_pos)
-			throw std::runtime_error("XXX invalid header");
-
-		string_view type_str((char const *)buf, (char const *)buf + r);
-		if (type_str == "commit")
-			obj.type = object_type::commit;
-		else if (type_str == "tree")
-			obj.type = object_type::tree;
-		else if (type_str == "blob")
-			obj.type = object_type::blob;
-		else if (type_str == "tag")
-			obj.type = object_type::tag;
-		else
-			throw std::runtime_error("XXX unknown loose object type");
+		obj = op->get_object(oid, object_type::none);
+		if (obj.content)
+			return true;
+	}
+
+	return false;
+}
+
+bool gitdb::impl::has_packed_object(object_id const & oid)
+{
+	this->load_packs();
+
+	object_pack * op;
+	file_offset_t offs;
+	if (m_midx && m_midx->find(oid, op, offs))
+		return true;
 
-		obj.size = atoi((char const *)buf + r);
+	for (object_pack * op: m_unindexed_packs)
+	{
+		if (op->find_offset(oid, offs))
+			return true;
 	}
 
-	obj.content = std::make_shared<loose_stream>(std::move(f));
-	skip(*obj.content, nul_pos+1);
-	return obj;
+	return false;
+}
+
+bool gitdb::impl::get_loose_object(object_id const & oid, object & obj)
+{
+	std::string s = oid.base16();
+	file f;
+
+	if (!f.try_open(m_path + "/objects/" + s.substr(0, 2) + "/" + s.substr(2), /*readonly=*/true))
+		return false;
+
+	bool verify = m_verify_policy == verify_policy::always
+		|| (m_verify_policy == verify_policy::sampled && m_loose_reads % verify_sample_rate == 0);
+	++m_loose_reads;
+
+	std::shared_ptr<loose_stream> ls = std::make_shared<loose_stream>(std::move(f), verify? &oid: 0);
+	uint8_t const * buf = ls->m_head;
+	size_t r = ls->m_head_last - ls->m_head;
+
+	size_t nul_pos = std::find(buf, buf + r, 0) - buf;
+	if (nul_pos == r)
+		throw std::runtime_error("XXX invalid header");
+
+	r = std::find(buf, buf + nul_pos, ' ') - buf;
+	if (r == nul_pos)
+		throw std::runtime_error("XXX invalid header");
+
+	string_view type_str((char const *)buf, (char const *)buf + r);
+	if (type_str == "commit")
+		obj.type = object_type::commit;
+	else if (type_str == "tree")
+		obj.type = object_type::tree;
+	else if (type_str == "blob")
+		obj.type = object_type::blob;
+	else if (type_str == "tag")
+		obj.type = object_type::tag;
+	else
+		throw std::runtime_error("XXX unknown loose object type");
+
+	obj.size = atoi((char const *)buf + r);
+
+	ls->m_head_first += nul_pos + 1;
+	obj.content = ls;
+	return true;
+}
+
+gitdb::object gitdb::get_object(object_id oid)
+{
+	// Most objects are packed, so we only try to open loose objects
+	// we've seen when listing their fan-out directory.
+	object obj;
+	if (m_pimpl->is_loose(oid) && m_pimpl->get_loose_object(oid, obj))
+		return obj;
+
+	if (m_pimpl->get_packed_object(oid, obj))
+		return obj;
+
+	// The object may have been written since we've listed its directory.
+	m_pimpl->refresh_loose_dirs();
+	if (m_pimpl->is_loose(oid) && m_pimpl->get_loose_object(oid, obj))
+		return obj;
+
+	return object();
+}
+
+// Only looks the object up, nothing is read from it.
+bool gitdb::has_object(object_id oid)
+{
+	if (m_pimpl->is_loose(oid) || m_pimpl->has_packed_object(oid))
+		return true;
+
+	m_pimpl->refresh_loose_dirs();
+	return m_pimpl->is_loose(oid);
 }
 
 object_id gitdb::get_ref(string_view ref)
@@ -520,6 +1681,47 @@ object_id gitdb::get_ref(string_view ref, std::string & real_ref)
 	}
 }
 
+bool gitdb::get_commit_graph_entry(object_id oid, commit_graph_entry & entry)
+{
+	if (!m_pimpl->m_commit_graph_loaded)
+		m_pimpl->load_commit_graph();
+
+	for (auto && layer: m_pimpl->m_commit_graph)
+	{
+		uint8_t const * oids = layer->oids;
+
+		size_t pos;
+		bool found = find_oid_in_table(layer->fanout_table, oid, [oids](size_t i, uint8_t *) {
+			return oids + 20 * i;
+		}, pos);
+
+		if (found)
+		{
+			m_pimpl->read_commit_graph_entry(*layer, (uint32_t)pos, entry);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool gitdb::get_commit_graph_entry_at(uint32_t pos, commit_graph_entry & entry)
+{
+	if (!m_pimpl->m_commit_graph_loaded)
+		m_pimpl->load_commit_graph();
+
+	for (auto && layer: m_pimpl->m_commit_graph)
+	{
+		if (pos - layer->first_pos < layer->count)
+		{
+			m_pimpl->read_commit_graph_entry(*layer, pos - layer->first_pos, entry);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 static void parse_name_time(string_view name_time, std::string & name, uint32_t & time, int16_t & zone)
 {
 	int space_count = 0;
@@ -576,31 +1778,100 @@ gitdb::commit_t gitdb::get_commit(object_id oid)
 	return res;
 }
 
-gitdb::tree_t gitdb::get_tree(object_id oid)
+gitdb::tree_view::tree_view()
 {
-	gitdb::tree_t res;
+}
 
-	std::vector<uint8_t> cnt = this->get_object_content(oid, object_type::tree);
-	uint8_t const * p = cnt.data();
-	uint8_t const * last = p + cnt.size();
+gitdb::tree_view::tree_view(std::shared_ptr<std::vector<uint8_t> const> content)
+	: m_content(std::move(content))
+{
+}
 
-	while (p != last)
+gitdb::tree_view::iterator gitdb::tree_view::begin() const
+{
+	if (!m_content)
+		return iterator(0, 0);
+	return iterator(m_content->data(), m_content->data() + m_content->size());
+}
+
+gitdb::tree_view::iterator gitdb::tree_view::end() const
+{
+	if (!m_content)
+		return iterator(0, 0);
+	uint8_t const * last = m_content->data() + m_content->size();
+	return iterator(last, last);
+}
+
+gitdb::tree_view::iterator::iterator(uint8_t const * p, uint8_t const * last)
+	: m_p(p), m_last(last)
+{
+	this->parse();
+}
+
+gitdb::tree_view::entry const & gitdb::tree_view::iterator::operator*() const
+{
+	return m_entry;
+}
+
+gitdb::tree_view::entry const * gitdb::tree_view::iterator::operator->() const
+{
+	return &m_entry;
+}
+
+gitdb::tree_view::iterator & gitdb::tree_view::iterator::operator++()
+{
+	m_p = m_next;
+	this->parse();
+	return *this;
+}
+
+void gitdb::tree_view::iterator::parse()
+{
+	if (m_p == m_last)
+		return;
+
+	uint8_t const * nul_pos = std::find(m_p, m_last, 0);
+	if (m_last - nul_pos < 21)
+		throw std::runtime_error("XXX malformed tree object");
+
+	uint8_t const * sp_pos = std::find(m_p, nul_pos, ' ');
+	if (sp_pos == nul_pos)
+		throw std::runtime_error("XXX malformed tree object");
+
+	uint32_t mode = 0;
+	for (uint8_t const * p = m_p; p != sp_pos; ++p)
+		mode = (mode << 3) | (*p - '0');
+
+	m_entry.mode = mode;
+	m_entry.name = string_view((char const *)sp_pos + 1, (char const *)nul_pos);
+	m_entry.oid = nul_pos + 1;
+	m_next = nul_pos + 21;
+}
+
+gitdb::tree_view gitdb::get_tree_view(object_id oid)
+{
+	cached_object obj;
+	if (!m_pimpl->m_tree_cache.find(oid, obj))
 	{
-		uint8_t const * nul_pos = std::find(p, last, 0);
-		if (last - nul_pos < 21)
-			throw std::runtime_error("XXX malformed tree object");
+		obj.type = object_type::tree;
+		obj.content = std::make_shared<std::vector<uint8_t> const>(this->get_object_content(oid, object_type::tree));
+		m_pimpl->m_tree_cache.insert(oid, obj);
+	}
+
+	return tree_view(obj.content);
+}
 
-		uint8_t const * sp_pos = std::find(p, nul_pos, ' ');
-		if (sp_pos == nul_pos)
-			throw std::runtime_error("XXX malformed tree object");
+gitdb::tree_t gitdb::get_tree(object_id oid)
+{
+	gitdb::tree_t res;
 
+	for (tree_view::entry const & e: this->get_tree_view(oid))
+	{
 		tree_entry_t te;
-		te.mode = strtol((char const *)p, 0, 8);
-		te.name.assign(sp_pos + 1, nul_pos);
-		te.oid = object_id(nul_pos + 1);
+		te.mode = e.mode;
+		te.name.assign(e.name);
+		te.oid = object_id(e.oid);
 		res.push_back(std::move(te));
-
-		p = nul_pos + 21;
 	}
 
 	return res;
@@ -616,406 +1887,2194 @@ std::shared_ptr<istream> gitdb::get_blob_stream(object_id oid)
 	return this->get_object_stream(oid, object_type::blob);
 }
 
-struct index_entry
+gitdb::object_bitmap::object_bitmap()
+	: m_size(0)
 {
-public:
-	uint32_t ctime;
-//	uint32_t ctime_nano;
-	uint32_t mtime;
-//	uint32_t mtime_nano;
-//	uint32_t dev;
-//	uint32_t ino;
-	uint32_t mode;
-//	uint32_t uid;
-//	uint32_t gid;
-	uint32_t size;
-	object_id oid;
-//	uint16_t flags;
-	std::string name;
-	std::string cannon_name;
-	std::vector<index_entry> children;
+}
 
-	index_entry()
-		: ctime(0), mtime(0), mode(0), size(0)
+gitdb::object_bitmap::object_bitmap(size_t size)
+	: m_words((size + 63) / 64), m_size(size)
+{
+}
+
+gitdb::object_bitmap::object_bitmap(size_t size, std::vector<uint64_t> && words)
+	: m_words(std::move(words)), m_size(size)
+{
+	assert(m_words.size() == (size + 63) / 64);
+
+	// Runs of ones may extend past the last object.
+	if (size % 64)
+		m_words.back() &= (uint64_t(1) << (size % 64)) - 1;
+}
+
+size_t gitdb::object_bitmap::size() const
+{
+	return m_size;
+}
+
+size_t gitdb::object_bitmap::count() const
+{
+	size_t r = 0;
+	for (uint64_t w: m_words)
 	{
+		w = w - ((w >> 1) & 0x5555555555555555);
+		w = (w & 0x3333333333333333) + ((w >> 2) & 0x3333333333333333);
+		w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0f;
+		r += (size_t)((w * 0x0101010101010101) >> 56);
 	}
+	return r;
+}
 
-	index_entry(index_entry && o)
-		: ctime(o.ctime), mtime(o.mtime), mode(o.mode), size(o.size), oid(o.oid),
-		name(std::move(o.name)), cannon_name(std::move(o.cannon_name)), children(std::move(o.children))
+bool gitdb::object_bitmap::test(size_t pos) const
+{
+	assert(pos < m_size);
+	return (m_words[pos / 64] >> (pos % 64)) & 1;
+}
+
+void gitdb::object_bitmap::set(size_t pos)
+{
+	assert(pos < m_size);
+	m_words[pos / 64] |= uint64_t(1) << (pos % 64);
+}
+
+gitdb::object_bitmap & gitdb::object_bitmap::operator|=(object_bitmap const & rhs)
+{
+	if (rhs.m_size != m_size)
+		throw std::runtime_error("XXX bitmap size mismatch");
+
+	for (size_t i = 0; i != m_words.size(); ++i)
+		m_words[i] |= rhs.m_words[i];
+	return *this;
+}
+
+gitdb::object_bitmap & gitdb::object_bitmap::operator&=(object_bitmap const & rhs)
+{
+	if (rhs.m_size != m_size)
+		throw std::runtime_error("XXX bitmap size mismatch");
+
+	for (size_t i = 0; i != m_words.size(); ++i)
+		m_words[i] &= rhs.m_words[i];
+	return *this;
+}
+
+gitdb::object_bitmap & gitdb::object_bitmap::operator-=(object_bitmap const & rhs)
+{
+	if (rhs.m_size != m_size)
+		throw std::runtime_error("XXX bitmap size mismatch");
+
+	for (size_t i = 0; i != m_words.size(); ++i)
+		m_words[i] &= ~rhs.m_words[i];
+	return *this;
+}
+
+static int compare_tree_objects(string_view lname, bool is_ldir, string_view rname, bool is_rdir)
+{
+	size_t clen = (std::min)(lname.size(), rname.size());
+	int r = memcmp(lname.data(), rname.data(), clen);
+	if (r != 0)
+		return r;
+
+	return (lname.size() == clen? (is_ldir? '/': 0): lname[clen])
+		- (rname.size() == clen? (is_rdir? '/': 0): rname[clen]);
+}
+
+static bool is_file(uint32_t mode)
+{
+	return (mode & 0xe000) == 0x8000;
+}
+
+static bool is_dir(uint32_t mode)
+{
+	return (mode & 0xe000) == 0x4000;
+}
+
+static bool is_gitlink(uint32_t mode)
+{
+	return (mode & 0xe000) == 0xe000;
+}
+
+static bool mark_reachable_tree(gitdb & db, pack_bitmap_index & bi, object_id const & tree_oid, gitdb::object_bitmap & objects)
+{
+	size_t pos;
+	if (!bi.find_position(tree_oid, pos))
+		return false;
+
+	// A marked tree is either complete or being completed by our caller.
+	if (objects.test(pos))
+		return true;
+	objects.set(pos);
+
+	for (auto && te: db.get_tree_view(tree_oid))
 	{
+		if (is_gitlink(te.mode))
+			continue;
+
+		object_id oid(te.oid);
+		if (is_dir(te.mode))
+		{
+			if (!mark_reachable_tree(db, bi, oid, objects))
+				return false;
+		}
+		else
+		{
+			if (!bi.find_position(oid, pos))
+				return false;
+			objects.set(pos);
+		}
 	}
 
-private:
-	index_entry(index_entry const &);
-	index_entry & operator=(index_entry const &);
-};
+	return true;
+}
 
-struct git_wd::impl
+bool gitdb::reachable_objects(std::vector<object_id> const & tips, object_bitmap & objects)
 {
-	gitdb * m_db;
-	std::string m_path;
-	std::vector<index_entry> m_root;
+	if (!m_pimpl->m_bitmap_loaded)
+		m_pimpl->load_bitmap_index();
+
+	pack_bitmap_index * bi = m_pimpl->m_bitmap.get();
+	if (!bi)
+		return false;
+
+	objects = object_bitmap(bi->object_count);
+
+	// Commits with a bitmap contribute their whole history at once. We only
+	// walk from the tips down to the nearest such commits. If any object on
+	// the way isn't in the bitmapped pack, the result can't represent it.
+	std::vector<object_id> pending(tips);
+	object_bitmap commit_bitmap;
+	while (!pending.empty())
+	{
+		object_id oid = pending.back();
+		pending.pop_back();
+
+		size_t pos;
+		if (!bi->find_position(oid, pos))
+			return false;
+
+		if (objects.test(pos))
+			continue;
+
+		if (bi->get_commit_bitmap(pos, commit_bitmap))
+		{
+			objects |= commit_bitmap;
+			continue;
+		}
+
+		if (bi->type_bitmaps[1].test(pos))
+		{
+			if (!mark_reachable_tree(*this, *bi, oid, objects))
+				return false;
+			continue;
+		}
+
+		objects.set(pos);
+
+		if (bi->type_bitmaps[0].test(pos))
+		{
+			commit_t c = this->get_commit(oid);
+			if (!mark_reachable_tree(*this, *bi, c.tree_oid, objects))
+				return false;
+			pending.insert(pending.end(), c.parent_oids.begin(), c.parent_oids.end());
+		}
+		else if (bi->type_bitmaps[3].test(pos))
+		{
+			std::shared_ptr<istream> ss = this->get_object_stream(oid, object_type::tag);
+			stream_reader sr(*ss);
+
+			std::string line = sr.read_line();
+			if (!starts_with(line, "object "))
+				throw std::runtime_error("XXX malformed tag object");
+			pending.push_back(object_id(string_view(line).substr(7)));
+		}
+	}
+
+	return true;
+}
+
+bool gitdb::objects_of_type(object_type type, object_bitmap & objects)
+{
+	if (!m_pimpl->m_bitmap_loaded)
+		m_pimpl->load_bitmap_index();
+
+	if (!m_pimpl->m_bitmap || type < object_type::commit || type > object_type::tag)
+		return false;
+
+	objects = m_pimpl->m_bitmap->type_bitmaps[(int)type - 1];
+	return true;
+}
+
+object_id gitdb::bitmap_object_id(size_t pos)
+{
+	pack_bitmap_index & bi = *m_pimpl->m_bitmap;
+	if (pos >= bi.object_count)
+		throw std::runtime_error("XXX bitmap position out of range");
+
+	uint8_t oid_buf[20];
+	return object_id(bi.pack->read_idx(8 + 256 * 4 + 20 * (file_offset_t)bi.pack_order[pos], oid_buf, 20));
+}
+
+file_offset_t gitdb::bitmap_object_disk_size(size_t pos)
+{
+	pack_bitmap_index & bi = *m_pimpl->m_bitmap;
+	if (pos >= bi.object_count)
+		throw std::runtime_error("XXX bitmap position out of range");
+
+	return bi.offsets[pos + 1] - bi.offsets[pos];
+}
+
+struct stat_time
+{
+	uint32_t sec;
+	uint32_t nsec;
 };
 
-git_wd::git_wd()
-	: m_pimpl(0)
+static bool operator<(stat_time const & lhs, stat_time const & rhs)
 {
+	return lhs.sec < rhs.sec || (lhs.sec == rhs.sec && lhs.nsec < rhs.nsec);
 }
 
-git_wd::~git_wd()
+// Whether something modified at `mtime` is racily clean with respect to an index
+// written at `index_mtime`, i.e. could have changed again unnoticed. Times without
+// sub-second data are zeroed there and are racy anywhere in the index's second.
+static bool is_racy(stat_time const & mtime, stat_time const & index_mtime)
 {
-	delete m_pimpl;
+	if (mtime.nsec == 0)
+		return mtime.sec >= index_mtime.sec;
+	return !(mtime < index_mtime);
 }
 
-void git_wd::open(gitdb & db, string_view path)
+// New stat data for an index entry whose file was found unchanged.
+struct refreshed_entry
 {
-	std::unique_ptr<impl> pimpl(new impl());
-	pimpl->m_db = &db;
-	pimpl->m_path = path;
+	uint8_t const * raw;
+	stat_time mtime;
+	uint32_t size;
+};
 
-	file fidx;
-	fidx.open(path + "/.git/index", /*readonly=*/true);
-	file::ifile fin(fidx.seekg(0));
+// Holds `<path>.lock` until it's either renamed over `path` or dropped.
+class lock_file
+{
+public:
+	explicit lock_file(std::string path)
+		: m_path(std::move(path)), m_lock_path(m_path + ".lock")
+	{
+	}
+
+	~lock_file()
+	{
+		if (m_file.is_open())
+		{
+			m_file.close();
+
+			try
+			{
+				file::remove(m_lock_path);
+			}
+			catch (...)
+			{
+			}
+		}
+	}
 
-	uint8_t header[12];
-	read_all(fin, header, sizeof header);
+	bool try_lock()
+	{
+		return m_file.try_create_new(m_lock_path);
+	}
 
-	if (header[0] != 'D' || header[1] != 'I' || header[2] != 'R' || header[3] != 'C'
-		|| load_be<uint32_t>(header + 4) != 2)
+	bool is_locked() const
 	{
-		throw std::runtime_error("XXX invalid index");
+		return m_file.is_open();
 	}
 
-	uint32_t entry_count = load_be<uint32_t>(header + 8);
-	uint32_t current_count = 0;
+	file & get()
+	{
+		return m_file;
+	}
+
+	void commit()
+	{
+		m_file.close();
+		file::rename(m_lock_path, m_path);
+	}
+
+private:
+	std::string m_path;
+	std::string m_lock_path;
+	file m_file;
+};
 
-	std::string current_dir_name;
-	std::vector<index_entry> * current_dir = &pimpl->m_root;
+// A compiled .gitignore and the stat data of the file it was read from.
+struct cached_gitignore
+{
+	uint32_t mtime;
+	uint32_t mtime_nsec;
+	file_offset_t size;
+	object_id oid;
+	git_ignore rules;
+};
 
-	std::vector<uint8_t> buffer;
-	while (current_count < entry_count)
+// The .gitignore files status found in the working tree, keyed by the name of
+// their directory. They're only read again once their stat data changes.
+class gitignore_cache
+{
+public:
+	// Returns the .gitignore at `path` in the directory `name`, whose stat data is in `de`,
+	// or null if it's gone.
+	std::shared_ptr<cached_gitignore const> get(std::string const & name, std::string const & path, directory_entry const & de)
 	{
-		size_t old_size = buffer.size();
-		buffer.resize(old_size + 8 * 1024);
+		{
+			std::lock_guard<std::mutex> l(m_mutex);
+			auto it = m_entries.find(name);
+			if (it != m_entries.end() && it->second->mtime == de.mtime && it->second->mtime_nsec == de.mtime_nsec
+				&& it->second->size == de.size)
+			{
+				return it->second;
+			}
+		}
 
-		size_t r = fin.read(buffer.data() + old_size, 8*1024);
-		if (r == 0)
-			throw std::runtime_error("XXX broken index");
+		file f;
+		if (!f.try_open(path, /*readonly=*/true))
+			return nullptr;
+
+		std::vector<uint8_t> content((size_t)f.size());
+		file::ifile fi(f.seekg(0));
+		read_all(fi, content.data(), content.size());
 
-		buffer.resize(old_size + r);
+		std::shared_ptr<cached_gitignore> entry = std::make_shared<cached_gitignore>();
+		entry->mtime = de.mtime;
+		entry->mtime_nsec = de.mtime_nsec;
+		entry->size = de.size;
 
-		uint8_t const * p = buffer.data();
-		uint8_t const * last = p + buffer.size();
-		while (current_count < entry_count && last - p > 62)
 		{
-			uint8_t const * n = p+62;
-			uint8_t const * name_start = n;
-			while (n != last && *n != 0)
-				++n;
+			mem_istream ms(content.data(), content.data() + content.size());
+			entry->oid = sha1(gitdb::object_type::blob, content.size(), ms);
+		}
 
-			uint8_t const * name_end = n;
-			if (n != last)
-				++n;
-			while ((n - p) % 8 != 0 && n != last)
-				++n;
+		mem_istream ms(content.data(), content.data() + content.size());
+		entry->rules.load(name, ms);
 
-			string_view full_name((char const *)name_start, (char const *)name_end);
-			if (n != last)
-			{
-				// We have a whole entry!
-				index_entry ie;
-
-				ie.ctime = load_be<uint32_t>(p);
-//				ie.ctime_nano = load_be<uint32_t>(p + 4);
-				ie.mtime = load_be<uint32_t>(p + 8);
-//				ie.mtime_nano = load_be<uint32_t>(p + 12);
-//				ie.dev = load_be<uint32_t>(p + 16);
-//				ie.ino = load_be<uint32_t>(p + 20);
-				ie.mode = load_be<uint32_t>(p + 24);
-//				ie.uid = load_be<uint32_t>(p + 28);
-//				ie.gid = load_be<uint32_t>(p + 32);
-				ie.size = load_be<uint32_t>(p + 36);
-				ie.oid = object_id(p + 40);
-//				ie.flags = load_be<uint16_t>(p + 60);
-
-				string_view suffix;
-				if (starts_with(full_name, current_dir_name))
-				{
-					suffix = string_view(full_name.begin() + current_dir_name.size(), full_name.end());
-				}
-				else
-				{
-					current_dir = &pimpl->m_root;
-					current_dir_name.clear();
-					suffix = full_name;
-				}
+		std::lock_guard<std::mutex> l(m_mutex);
+		m_entries[name] = entry;
+		return entry;
+	}
 
-				size_t pos = suffix.find('/');
-				while (pos < suffix.size())
-				{
-					string_view c0 = suffix.substr(0, pos);
-					if (current_dir->empty() || current_dir->back().name != c0)
-					{
-						index_entry ie = {};
-						ie.name = c0;
-						ie.cannon_name = cannonical_path(c0);
-						ie.mode = 0x4000;
-						current_dir->push_back(std::move(ie));
-					}
+private:
+	std::mutex m_mutex;
+	std::map<std::string, std::shared_ptr<cached_gitignore const> > m_entries;
+};
 
-					current_dir = &current_dir->back().children;
-					current_dir_name.append(suffix.data(), suffix.data() + pos + 1);
-					suffix = suffix.substr(pos + 1);
-					pos = suffix.find('/');
-				}
+// The state shared by a status walk.
+struct status_context
+{
+	stat_time index_mtime;
 
-				ie.name.assign(suffix);
-				ie.cannon_name.assign(cannonical_path(suffix));
+	// If set, the entries of files found unchanged despite their stat data
+	// are collected, unless they were modified after `refresh_time`.
+	bool refresh;
+	stat_time refresh_time;
+
+	gitignore_cache * gitignores;
+};
+
+// A node of the cache tree extension; subtrees are sorted by name.
+struct cache_tree_node
+{
+	string_view name;
+	bool valid;
+	object_id oid;
+	std::vector<cache_tree_node> subtrees;
+
+	cache_tree_node()
+		: valid(false)
+	{
+	}
+};
+
+// A directory of the untracked cache extension, its names point into the index.
+// Its untracked files can be reused while the directory keeps its `mtime` and
+// its .gitignore hashes to `exclude_oid`, which is null if there's none.
+struct untracked_cache_dir
+{
+	string_view name;
+	std::vector<string_view> untracked;
+	std::vector<untracked_cache_dir> dirs;
+
+	bool valid;
+	bool check_only;
+	stat_time mtime;
+	object_id exclude_oid;
+
+	untracked_cache_dir()
+		: valid(false), check_only(false)
+	{
+		mtime.sec = 0;
+		mtime.nsec = 0;
+	}
+};
 
-				current_dir->push_back(std::move(ie));
-				++current_count;
+// The untracked cache extension as git writes it.
+struct untracked_cache
+{
+	bool present;
+
+	std::vector<string_view> idents;
+	uint32_t dir_flags;
+	string_view exclude_per_dir;
+
+	stat_time info_exclude_mtime;
+	uint32_t info_exclude_size;
+	object_id info_exclude_oid;
+	object_id excludes_file_oid;
+
+	untracked_cache_dir root;
+
+	// The extension within the index. It can't be kept when the index is
+	// rewritten if some directory's stat data is racy against the old index.
+	uint8_t const * ext_first;
+	uint8_t const * ext_last;
+	bool racy;
+
+	untracked_cache()
+		: present(false), dir_flags(0), info_exclude_size(0), ext_first(0), ext_last(0), racy(false)
+	{
+		info_exclude_mtime.sec = 0;
+		info_exclude_mtime.nsec = 0;
+	}
+};
+
+// Returns the path of an index entry, which points into the index file.
+static string_view index_entry_path(uint8_t const * raw)
+{
+	char const * path = (char const *)raw + 62;
+
+	// Paths longer than the 12-bit length field are NUL-terminated.
+	size_t len = load_be<uint16_t>(raw + 60) & 0xfff;
+	if (len == 0xfff)
+		len = strlen(path);
+	return string_view(path, path + len);
+}
+
+// A file or a directory of the index. Directories cover a range of the
+// index's flat entry table and their children are only built by
+// `list_index_dir` when a walk gets to them.
+struct index_entry
+{
+public:
+	uint32_t ctime;
+	uint32_t ctime_nano;
+	uint32_t mtime;
+	uint32_t mtime_nano;
+	uint32_t dev;
+	uint32_t ino;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t size;
+	object_id oid;
+	uint16_t flags;
+	string_view name;
+	std::string cannon_name;
+
+	// For files, the entry in the index file.
+	uint8_t const * raw;
+
+	// For directories, the entries they cover and the length
+	// of their path, including the trailing slash.
+	uint8_t const * const * first;
+	uint8_t const * const * last;
+	size_t prefix_len;
+
+	bool listed;
+	std::vector<index_entry> children;
+
+	// For directories, whether `oid` holds the oid of their tree.
+	bool tree_valid;
+	cache_tree_node const * cache_tree;
+
+	index_entry()
+		: ctime(0), ctime_nano(0), mtime(0), mtime_nano(0), dev(0), ino(0), mode(0), uid(0), gid(0), size(0), flags(0),
+		raw(0), first(0), last(0), prefix_len(0), listed(false), tree_valid(false), cache_tree(0)
+	{
+	}
+
+	index_entry(index_entry && o)
+		: ctime(o.ctime), ctime_nano(o.ctime_nano), mtime(o.mtime), mtime_nano(o.mtime_nano), dev(o.dev), ino(o.ino),
+		mode(o.mode), uid(o.uid), gid(o.gid), size(o.size), oid(o.oid), flags(o.flags),
+		name(o.name), cannon_name(std::move(o.cannon_name)), raw(o.raw),
+		first(o.first), last(o.last), prefix_len(o.prefix_len),
+		listed(o.listed), children(std::move(o.children)),
+		tree_valid(o.tree_valid), cache_tree(o.cache_tree)
+	{
+	}
+
+private:
+	index_entry(index_entry const &);
+	index_entry & operator=(index_entry const &);
+};
+
+struct git_wd::impl
+{
+	gitdb * m_db;
+	std::string m_path;
+
+	// The index as read into memory; the range excludes the trailing checksum.
+	std::vector<uint8_t> m_index_buf;
+	uint8_t const * m_index_first;
+	uint8_t const * m_index_last;
+
+	// The entries in index order, i.e. sorted by path.
+	std::vector<uint8_t const *> m_entries;
+
+	stat_time m_index_mtime;
+	cache_tree_node m_cache_tree;
+	untracked_cache m_untracked_cache;
+
+	// We don't read the shared part of a split index, so we can't write it either.
+	bool m_split_index;
+
+	index_entry m_root;
+
+	// Kept when the index is read again.
+	std::unique_ptr<gitignore_cache> m_gitignores;
+
+	void write_index(file & f, std::vector<refreshed_entry> const & refreshed);
+};
+
+static cache_tree_node const * find_cache_subtree(cache_tree_node const * node, string_view name)
+{
+	if (!node)
+		return 0;
+
+	auto it = std::lower_bound(node->subtrees.begin(), node->subtrees.end(), name, [](cache_tree_node const & n, string_view name) {
+		return n.name < name;
+	});
+
+	if (it == node->subtrees.end() || it->name != name)
+		return 0;
+	return &*it;
+}
+
+static void list_index_dir(index_entry & dir)
+{
+	if (dir.listed)
+		return;
+	dir.listed = true;
+
+	for (uint8_t const * const * cur = dir.first; cur != dir.last;)
+	{
+		string_view path = index_entry_path(*cur);
+		string_view rest = path.substr(dir.prefix_len);
+
+		index_entry ie;
+
+		size_t slash = rest.find('/');
+		if (slash < rest.size())
+		{
+			// All the entries of a subdirectory share its prefix and thus
+			// are adjacent, the first one that doesn't ends the range.
+			string_view prefix = path.substr(0, dir.prefix_len + slash + 1);
+
+			ie.name = rest.substr(0, slash);
+			ie.mode = 0x4000;
+			ie.prefix_len = prefix.size();
+			ie.first = cur;
+			ie.last = std::partition_point(cur, dir.last, [prefix](uint8_t const * raw) {
+				return index_entry_path(raw).substr(0, prefix.size()) <= prefix;
+			});
+
+			ie.cache_tree = find_cache_subtree(dir.cache_tree, ie.name);
+			if (ie.cache_tree && ie.cache_tree->valid)
+			{
+				ie.oid = ie.cache_tree->oid;
+				ie.tree_valid = true;
+			}
+
+			cur = ie.last;
+		}
+		else
+		{
+			uint8_t const * p = *cur;
+
+			ie.ctime = load_be<uint32_t>(p);
+			ie.ctime_nano = load_be<uint32_t>(p + 4);
+			ie.mtime = load_be<uint32_t>(p + 8);
+			ie.mtime_nano = load_be<uint32_t>(p + 12);
+			ie.dev = load_be<uint32_t>(p + 16);
+			ie.ino = load_be<uint32_t>(p + 20);
+			ie.mode = load_be<uint32_t>(p + 24);
+			ie.uid = load_be<uint32_t>(p + 28);
+			ie.gid = load_be<uint32_t>(p + 32);
+			ie.size = load_be<uint32_t>(p + 36);
+			ie.oid = object_id(p + 40);
+			ie.flags = load_be<uint16_t>(p + 60);
+			ie.name = rest;
+			ie.raw = p;
+
+			++cur;
+		}
+
+		dir.children.push_back(std::move(ie));
+	}
+}
+
+// The cache tree extension stores a node for each directory: its name,
+// "<entry count> <subtree count>\n" and, unless the directory was
+// invalidated (the entry count is -1), the oid of its tree. Subtree
+// nodes follow their parent.
+static void read_cache_tree(uint8_t const *& p, uint8_t const * last, cache_tree_node & node)
+{
+	uint8_t const * name_end = std::find(p, last, 0);
+	if (name_end == last)
+		throw std::runtime_error("XXX invalid cache tree");
+
+	node.name = string_view((char const *)p, (char const *)name_end);
+	p = name_end + 1;
+
+	uint8_t const * line_end = std::find(p, last, '\n');
+	if (line_end == last)
+		throw std::runtime_error("XXX invalid cache tree");
+
+	char * count_end;
+	long entry_count = strtol((char const *)p, &count_end, 10);
+	if (*count_end != ' ')
+		throw std::runtime_error("XXX invalid cache tree");
+
+	long subtree_count = strtol(count_end + 1, &count_end, 10);
+	if ((uint8_t const *)count_end != line_end || subtree_count < 0)
+		throw std::runtime_error("XXX invalid cache tree");
+
+	p = line_end + 1;
+	if (entry_count >= 0)
+	{
+		if (last - p < 20)
+			throw std::runtime_error("XXX invalid cache tree");
+
+		node.oid = object_id(p);
+		node.valid = true;
+		p += 20;
+	}
+
+	for (long i = 0; i != subtree_count; ++i)
+	{
+		node.subtrees.push_back(cache_tree_node());
+		read_cache_tree(p, last, node.subtrees.back());
+	}
+
+	std::sort(node.subtrees.begin(), node.subtrees.end(), [](cache_tree_node const & lhs, cache_tree_node const & rhs) {
+		return lhs.name < rhs.name;
+	});
+}
+
+// The untracked cache stores integers the way offset deltas are encoded: each
+// continuation adds one, so that every value has a single encoding.
+static size_t get_offset_varint(uint8_t const *& p, uint8_t const * last)
+{
+	if (p == last)
+		throw std::runtime_error("XXX invalid untracked cache");
+
+	size_t res = *p & 0x7f;
+	while (*p++ & 0x80)
+	{
+		if (p == last)
+			throw std::runtime_error("XXX invalid untracked cache");
+		res = ((res + 1) << 7) | (*p & 0x7f);
+	}
+	return res;
+}
+
+static string_view get_cstring(uint8_t const *& p, uint8_t const * last)
+{
+	uint8_t const * str_end = std::find(p, last, 0);
+	if (str_end == last)
+		throw std::runtime_error("XXX invalid untracked cache");
+
+	string_view res((char const *)p, (char const *)str_end);
+	p = str_end + 1;
+	return res;
+}
+
+// Directories are stored depth-first, `dirs` collects them in that order,
+// since that's what the bitmaps following them are indexed by.
+static void read_untracked_dir(uint8_t const *& p, uint8_t const * last, untracked_cache_dir & dir, std::vector<untracked_cache_dir *> & dirs)
+{
+	dirs.push_back(&dir);
+
+	size_t untracked_count = get_offset_varint(p, last);
+	size_t dir_count = get_offset_varint(p, last);
+	if (untracked_count > (size_t)(last - p) || dir_count > (size_t)(last - p))
+		throw std::runtime_error("XXX invalid untracked cache");
+
+	dir.name = get_cstring(p, last);
+
+	dir.untracked.reserve(untracked_count);
+	for (size_t i = 0; i != untracked_count; ++i)
+		dir.untracked.push_back(get_cstring(p, last));
+
+	dir.dirs.resize(dir_count);
+	for (untracked_cache_dir & subdir: dir.dirs)
+		read_untracked_dir(p, last, subdir, dirs);
+}
+
+static void sort_untracked_dirs(untracked_cache_dir & dir)
+{
+	std::sort(dir.dirs.begin(), dir.dirs.end(), [](untracked_cache_dir const & lhs, untracked_cache_dir const & rhs) {
+		return lhs.name < rhs.name;
+	});
+
+	for (untracked_cache_dir & subdir: dir.dirs)
+		sort_untracked_dirs(subdir);
+}
+
+// Reads an EWAH bitmap over the directories and calls `fn` with each one whose bit is set.
+template <typename F>
+static void for_each_untracked_dir(uint8_t const *& p, uint8_t const * last, std::vector<untracked_cache_dir *> const & dirs, F fn)
+{
+	uint8_t const * next = skip_ewah(p, last);
+
+	std::vector<uint64_t> words((load_be<uint32_t>(p) + (size_t)63) / 64);
+	xor_ewah(p, words);
+	p = next;
+
+	for (size_t pos = 0; pos != words.size() * 64; ++pos)
+	{
+		if ((words[pos / 64] >> (pos % 64)) & 1)
+		{
+			if (pos >= dirs.size())
+				throw std::runtime_error("XXX invalid untracked cache");
+			fn(*dirs[pos]);
+		}
+	}
+}
+
+static void read_untracked_cache(uint8_t const * p, uint8_t const * last, stat_time const & index_mtime, untracked_cache & uc)
+{
+	size_t ident_len = get_offset_varint(p, last);
+	if (ident_len > (size_t)(last - p))
+		throw std::runtime_error("XXX invalid untracked cache");
+
+	for (uint8_t const * ident_last = p + ident_len; p != ident_last;)
+		uc.idents.push_back(get_cstring(p, ident_last));
+
+	// The stat data of info/exclude and of core.excludesFile, each laid
+	// out like in an index entry, then the flags and both files' hashes.
+	if (last - p < 116)
+		throw std::runtime_error("XXX invalid untracked cache");
+
+	uc.info_exclude_mtime.sec = load_be<uint32_t>(p + 8);
+	uc.info_exclude_mtime.nsec = load_be<uint32_t>(p + 12);
+	uc.info_exclude_size = load_be<uint32_t>(p + 32);
+	uc.dir_flags = load_be<uint32_t>(p + 72);
+	uc.info_exclude_oid = object_id(p + 76);
+	uc.excludes_file_oid = object_id(p + 96);
+	p += 116;
+
+	uc.exclude_per_dir = get_cstring(p, last);
+
+	size_t dir_count = get_offset_varint(p, last);
+	if (dir_count != 0)
+	{
+		std::vector<untracked_cache_dir *> dirs;
+		read_untracked_dir(p, last, uc.root, dirs);
+		if (dirs.size() != dir_count)
+			throw std::runtime_error("XXX invalid untracked cache");
+
+		uint8_t const * valid = p;
+		p = skip_ewah(p, last);
+		for_each_untracked_dir(p, last, dirs, [](untracked_cache_dir & dir) {
+			dir.check_only = true;
+		});
+
+		uint8_t const * oid_valid = p;
+		p = skip_ewah(p, last);
+
+		// Valid directories have their stat data stored after the bitmaps,
+		// those with a .gitignore have its hash stored after that.
+		for_each_untracked_dir(valid, last, dirs, [&](untracked_cache_dir & dir) {
+			if (last - p < 36)
+				throw std::runtime_error("XXX invalid untracked cache");
+
+			dir.valid = true;
+			dir.mtime.sec = load_be<uint32_t>(p + 8);
+			dir.mtime.nsec = load_be<uint32_t>(p + 12);
+			if (!(dir.mtime < index_mtime))
+				uc.racy = true;
+			p += 36;
+		});
+
+		for_each_untracked_dir(oid_valid, last, dirs, [&](untracked_cache_dir & dir) {
+			if (last - p < 20)
+				throw std::runtime_error("XXX invalid untracked cache");
+
+			dir.exclude_oid = object_id(p);
+			p += 20;
+		});
+
+		sort_untracked_dirs(uc.root);
+	}
+
+	uc.present = true;
+}
+
+git_wd::git_wd()
+	: m_pimpl(0)
+{
+}
+
+git_wd::~git_wd()
+{
+	delete m_pimpl;
+}
+
+void git_wd::open(gitdb & db, string_view path)
+{
+	std::unique_ptr<impl> pimpl(new impl());
+	pimpl->m_db = &db;
+	pimpl->m_path = path;
+
+	file fidx;
+	fidx.open(path + "/.git/index", /*readonly=*/true);
+	fidx.mtime(pimpl->m_index_mtime.sec, pimpl->m_index_mtime.nsec);
+
+	// An empty index is as broken as a truncated one; git always writes the header.
+	file_offset_t size = fidx.size();
+	if (size < 12 + 20)
+		throw std::runtime_error("XXX invalid index");
+
+	// The index is read into memory rather than mapped, so that nothing holds on
+	// to the file and git can replace it while we're open. Status touches every
+	// entry anyway, the read costs about as much as faulting the mapping in would.
+	if (size != (size_t)size)
+		throw std::runtime_error("XXX index too large");
+
+	file::ifile fin(fidx.seekg(0));
+	pimpl->m_index_buf.resize((size_t)size);
+	read_all(fin, pimpl->m_index_buf.data(), pimpl->m_index_buf.size());
+
+	uint8_t const * first = pimpl->m_index_buf.data();
+	uint8_t const * last = first + pimpl->m_index_buf.size();
+
+	if (last - first < 12 + 20)
+		throw std::runtime_error("XXX invalid index");
+
+	if (first[0] != 'D' || first[1] != 'I' || first[2] != 'R' || first[3] != 'C'
+		|| load_be<uint32_t>(first + 4) != 2)
+	{
+		throw std::runtime_error("XXX invalid index");
+	}
+
+	uint32_t entry_count = load_be<uint32_t>(first + 8);
+
+	// The index ends with its checksum.
+	last -= 20;
+
+	pimpl->m_index_first = first;
+	pimpl->m_index_last = last;
+	pimpl->m_split_index = false;
+
+	// Entries are padded with NULs to a multiple of 8 bytes,
+	// there is at least one NUL after the path.
+	uint8_t const * p = first + 12;
+	pimpl->m_entries.reserve(entry_count);
+	for (uint32_t i = 0; i != entry_count; ++i)
+	{
+		if (last - p < 64)
+			throw std::runtime_error("XXX broken index");
+
+		uint8_t const * path_last = std::find(p + 62, last, 0);
+		if (path_last == last)
+			throw std::runtime_error("XXX broken index");
+
+		size_t entry_len = ((path_last - p) + 8) & ~(size_t)7;
+		if (entry_len > (size_t)(last - p))
+			throw std::runtime_error("XXX broken index");
+
+		pimpl->m_entries.push_back(p);
+		p += entry_len;
+	}
+
+	pimpl->m_root.mode = 0x4000;
+	pimpl->m_root.first = pimpl->m_entries.data();
+	pimpl->m_root.last = pimpl->m_entries.data() + pimpl->m_entries.size();
+
+	// Extensions follow the entries.
+	while (p != last)
+	{
+		if (last - p < 8)
+			throw std::runtime_error("XXX broken index");
+
+		uint32_t signature = load_be<uint32_t>(p);
+		uint32_t size = load_be<uint32_t>(p + 4);
+		p += 8;
+
+		if (size > (size_t)(last - p))
+			throw std::runtime_error("XXX broken index");
+
+		if (signature == 0x54524545 /*TREE*/)
+		{
+			uint8_t const * q = p;
+			read_cache_tree(q, p + size, pimpl->m_cache_tree);
+
+			pimpl->m_root.cache_tree = &pimpl->m_cache_tree;
+			if (pimpl->m_cache_tree.valid)
+			{
+				pimpl->m_root.oid = pimpl->m_cache_tree.oid;
+				pimpl->m_root.tree_valid = true;
+			}
+		}
+		else if (signature == 0x6c696e6b /*link*/)
+		{
+			pimpl->m_split_index = true;
+		}
+		else if (signature == 0x554e5452 /*UNTR*/)
+		{
+			read_untracked_cache(p, p + size, pimpl->m_index_mtime, pimpl->m_untracked_cache);
+			pimpl->m_untracked_cache.ext_first = p - 8;
+			pimpl->m_untracked_cache.ext_last = p + size;
+		}
+
+		p += size;
+	}
+
+	// The .gitignore files don't depend on the index.
+	if (m_pimpl && m_pimpl->m_path == pimpl->m_path)
+		pimpl->m_gitignores = std::move(m_pimpl->m_gitignores);
+	else
+		pimpl->m_gitignores.reset(new gitignore_cache());
+
+	delete m_pimpl;
+	m_pimpl = pimpl.release();
+}
+
+git_wd::git_wd(git_wd && o)
+	: m_pimpl(o.m_pimpl)
+{
+	o.m_pimpl = 0;
+}
+
+git_wd & git_wd::operator=(git_wd && o)
+{
+	std::swap(m_pimpl, o.m_pimpl);
+	return *this;
+}
+
+string_view git_wd::path() const
+{
+	return m_pimpl->m_path;
+}
+
+#include "checkout_filter.h"
+
+static void add_object_header(sha1_state & ss, gitdb::object_type type, file_offset_t size);
+
+// Files are mapped and hashed in a single pass over their content, the filtered
+// size is known up front by counting the carriage returns `checkin_filter`
+// would drop. Files we can't map are read through the filter into memory.
+static git_wd::file_status check_file_status(string_view fname, object_id const & expected_oid)
+{
+	file fin;
+	if (!fin.try_open(fname, /*readonly=*/true))
+		return git_wd::file_status::deleted;
+
+	sha1_state ss;
+
+	file_view view;
+	if (view.try_map(fin))
+	{
+		uint8_t const * first = view.begin();
+		uint8_t const * last = view.end();
+
+		size_t size = last - first - std::count(first, last, '\r');
+		add_object_header(ss, gitdb::object_type::blob, size);
+
+		while (first != last)
+		{
+			uint8_t const * cr = (uint8_t const *)memchr(first, '\r', last - first);
+			if (!cr)
+				cr = last;
+
+			ss.add(first, cr);
+			first = cr == last? last: cr + 1;
+		}
+	}
+	else
+	{
+		std::vector<uint8_t> content;
+
+		file::ifile fi(fin.seekg(0));
+		checkin_filter cf(fi);
+
+		uint8_t buf[64*1024];
+		while (size_t r = cf.read(buf, sizeof buf))
+			content.insert(content.end(), buf, buf + r);
+
+		add_object_header(ss, gitdb::object_type::blob, content.size());
+		ss.add(content.data(), content.data() + content.size());
+	}
+
+	uint8_t hash[20];
+	ss.finish(hash);
+
+	if (object_id(hash) != expected_oid)
+		return git_wd::file_status::modified;
+	return git_wd::file_status::none;
+}
+
+static bool cannon_less(index_entry const & lhs, index_entry const & rhs)
+{
+	int r = cmp(lhs.cannon_name, rhs.cannon_name);
+	if (r == 0)
+		return lhs.mode < rhs.mode;
+	return r < 0;
+}
+
+// Canonical names are only needed to match entries against directory
+// listings, so they're computed here rather than for the whole index.
+static void sort_cannonical(std::vector<index_entry *> & d)
+{
+	for (index_entry * ie: d)
+	{
+		if (ie->cannon_name.empty())
+			ie->cannon_name = cannonical_path(ie->name);
+	}
+
+	std::stable_sort(d.begin(), d.end(), [](index_entry const * lhs, index_entry const * rhs) {
+		return cannon_less(*lhs, *rhs);
+	});
+}
+
+// Whether a file still has the stat data recorded in the index. Windows' directory
+// listings don't report ctime, inode, device or owner, so only the modification
+// time and size take part; Git for Windows leaves the others zero anyway.
+//
+// An entry modified no earlier than the index was written is racily clean:
+// the file may have changed again within the same timestamp, so its stat
+// data can't vouch for its content.
+static bool stat_matches(index_entry const & ie, directory_entry const & de, stat_time const & index_mtime)
+{
+	if (ie.mtime != de.mtime || ie.size != (uint32_t)de.size)
+		return false;
+
+	// Indices written without sub-second timestamps have them zeroed.
+	if (ie.mtime_nano != 0 && ie.mtime_nano != de.mtime_nsec)
+		return false;
+
+	stat_time mtime = { ie.mtime, ie.mtime_nano };
+	return !is_racy(mtime, index_mtime);
+}
+
+// The ignore rules of a directory, which keep those of their parents alive
+// for as long as any task below the directory is pending. The rules of
+// a .gitignore take precedence over those of its parents, and the root
+// holds the rules given to status.
+struct status_ignore
+{
+	std::shared_ptr<status_ignore const> parent;
+	std::shared_ptr<git_ignore const> rules;
+
+	status_ignore(std::shared_ptr<status_ignore const> const & parent, std::shared_ptr<git_ignore const> const & rules)
+		: parent(parent), rules(rules)
+	{
+	}
+
+	bool match(string_view path) const
+	{
+		status_ignore const * node = this;
+		for (; node->parent; node = node->parent.get())
+		{
+			bool ignored;
+			if (node->rules->try_match(path, ignored))
+				return ignored;
+		}
+
+		return node->rules->match(path);
+	}
+};
+
+// The rules given to status are only borrowed.
+static std::shared_ptr<status_ignore const> root_ignore_rules(git_ignore const & ign)
+{
+	return std::make_shared<status_ignore>(nullptr, std::shared_ptr<git_ignore const>(&ign, [](git_ignore const *) {}));
+}
+
+// Adds the rules of a .gitignore below `parent`.
+static std::shared_ptr<status_ignore const> add_ignore_rules(std::shared_ptr<status_ignore const> const & parent,
+	std::shared_ptr<cached_gitignore const> const & gitignore)
+{
+	return std::make_shared<status_ignore>(parent, std::shared_ptr<git_ignore const>(gitignore, &gitignore->rules));
+}
+
+// A directory of the working tree to compare against the index. Several index
+// directories may map to it (e.g. "Dir" and "dir"), they're only ever listed
+// by the task, so no two tasks touch the same `index_entry`.
+struct status_task
+{
+	std::string path_prefix;
+	std::string name;
+	std::vector<index_entry *> dirs;
+	std::shared_ptr<status_ignore const> ign;
+
+	// The directory's modification time and its entry in the untracked cache,
+	// unless the .gitignore of some parent changed since the cache was written.
+	stat_time mtime;
+	untracked_cache_dir const * uc;
+
+	// Whether to compare the subdirectories too.
+	bool recurse;
+
+	// Whether the directory or one of its parents is ignored,
+	// in which case nothing untracked in it is reported.
+	bool ignored;
+};
+
+static untracked_cache_dir const * find_untracked_subdir(untracked_cache_dir const * dir, string_view name)
+{
+	auto it = std::lower_bound(dir->dirs.begin(), dir->dirs.end(), name, [](untracked_cache_dir const & d, string_view name) {
+		return d.name < name;
+	});
+
+	if (it == dir->dirs.end() || it->name != name)
+		return 0;
+	return &*it;
+}
+
+// A path reported by status; directories sort as if their name ended with a slash.
+struct status_entry
+{
+	std::string name;
+	git_wd::file_status status;
+	bool dir;
+
+	status_entry(std::string const & name, git_wd::file_status status, bool dir)
+		: name(name), status(status), dir(dir)
+	{
+	}
+};
+
+static bool operator<(status_entry const & lhs, status_entry const & rhs)
+{
+	return compare_tree_objects(lhs.name, lhs.dir, rhs.name, rhs.dir) < 0;
+}
+
+// Whether `e` is reported before the content of the subdirectory `sub`.
+static bool precedes_subdir(status_entry const & e, status_task const & sub)
+{
+	return compare_tree_objects(e.name, e.dir, sub.name, false) < 0;
+}
+
+// Compares one directory; its subdirectories are appended to `subdirs` rather than recursed into.
+// We expect index entries here to be sorted using `compare_filenames` and then by `mode`.
+static void status_dir(status_task & task, status_context const & ctx, std::vector<status_entry> & st,
+	std::vector<refreshed_entry> & refreshed, std::vector<status_task> & subdirs)
+{
+	std::string & current_path_prefix = task.path_prefix;
+	std::string & current_name = task.name;
+
+	std::vector<index_entry *> d;
+	for (index_entry * dir: task.dirs)
+	{
+		list_index_dir(*dir);
+		for (index_entry & ie: dir->children)
+			d.push_back(&ie);
+	}
+	sort_cannonical(d);
+
+	std::shared_ptr<status_ignore const> ign_node = task.ign;
+	untracked_cache_dir const * uc = task.uc;
+
+	size_t path_prefix_len = current_path_prefix.size();
+	size_t name_len = current_name.size();
+
+	// If the directory wasn't modified since the untracked cache was written, its names
+	// are still what the cache says, so only the tracked files have to be looked at.
+	// Note that the cached names were already filtered with the ignore rules.
+	bool fresh = uc && uc->valid && !uc->check_only
+		&& uc->mtime.sec == task.mtime.sec && (uc->mtime.nsec == 0 || uc->mtime.nsec == task.mtime.nsec)
+		&& uc->mtime < ctx.index_mtime;
+
+	std::vector<directory_entry> dir_content;
+	if (!fresh)
+		dir_content = listdir(current_path_prefix);
+
+	// The .gitignore is found in the listing, or if the names didn't change,
+	// it's there if it was when the untracked cache was written.
+	static std::string const gitignore_cannon_name = cannonical_path(".gitignore");
+
+	directory_entry gitignore_stat;
+	directory_entry const * gitignore_de = 0;
+	if (!fresh)
+	{
+		for (directory_entry const & de: dir_content)
+		{
+			if (de.cannon_name == gitignore_cannon_name && !is_dir(de.mode))
+				gitignore_de = &de;
+		}
+	}
+	else if (uc->exclude_oid != object_id() && try_stat(current_path_prefix + ".gitignore", gitignore_stat)
+		&& !is_dir(gitignore_stat.mode))
+	{
+		gitignore_de = &gitignore_stat;
+	}
+
+	std::shared_ptr<cached_gitignore const> gitignore;
+	if (gitignore_de)
+		gitignore = ctx.gitignores->get(current_name, current_path_prefix + ".gitignore", *gitignore_de);
+
+	if (gitignore)
+	{
+		if (uc && gitignore->oid != uc->exclude_oid)
+			uc = 0;
+		ign_node = add_ignore_rules(ign_node, gitignore);
+	}
+	else if (uc && uc->exclude_oid != object_id())
+	{
+		uc = 0;
+	}
+
+	bool cached = fresh && uc;
+	if (cached)
+	{
+		for (index_entry const * ie: d)
+		{
+			directory_entry de;
+			current_path_prefix.append(ie->name.data(), ie->name.size());
+			if (try_stat(current_path_prefix, de))
+				dir_content.push_back(std::move(de));
+			current_path_prefix.resize(path_prefix_len);
+		}
+
+		// Untracked directories are listed with a trailing slash.
+		for (string_view name: uc->untracked)
+		{
+			if (ends_with(name, "/"))
+				dir_content.emplace_back(name.trim_right(1), 0, 0, 0, 0x4000);
+			else
+				dir_content.emplace_back(name, 0, 0, 0, 0x8000);
+		}
+	}
+	else if (fresh)
+	{
+		dir_content = listdir(current_path_prefix);
+	}
+
+	std::stable_sort(dir_content.begin(), dir_content.end(), [](directory_entry const & lhs, directory_entry const & rhs) {
+		return lhs.cannon_name < rhs.cannon_name;
+	});
+
+	if (cached)
+	{
+		dir_content.erase(std::unique(dir_content.begin(), dir_content.end(), [](directory_entry const & lhs, directory_entry const & rhs) {
+			return lhs.cannon_name == rhs.cannon_name;
+		}), dir_content.end());
+	}
+
+	// There won't be duplicates (relative to `compare_filenames`) in `dir_content`, but
+	// there might be duplicates in `d` (e.g. "File" and "file" are distinct according
+	// to git's basename ordering, but are the same according to the Windows'
+	// case-insensitive ordering.
+
+	index_entry * const * d_first = d.data();
+	index_entry * const * d_last = d.data() + d.size();
+
+	for (directory_entry const & de: dir_content)
+	{
+		int r = d_first == d_last? 1: cmp((*d_first)->cannon_name, de.cannon_name);
+
+		while (r < 0)
+		{
+			current_name.append((*d_first)->name.data(), (*d_first)->name.size());
+			st.emplace_back(current_name, git_wd::file_status::deleted, is_dir((*d_first)->mode));
+			current_name.resize(name_len);
+
+			++d_first;
+			r = d_first == d_last? 1: cmp((*d_first)->cannon_name, de.cannon_name);
+		}
+
+		if (r == 0)
+		{
+			// Note that we can't tell if something is a symlink on Windows,
+			// so we need to filter that bit out.
+			if ((de.mode & 0xc000) == ((*d_first)->mode & 0xc000))
+			{
+				if (is_gitlink(de.mode))
+				{
+					// XXX
+				}
+				else if (is_dir(de.mode))
+				{
+					// We search for the equal range in `d` here, since we'll have to merge
+					// all the distinct directories together.
+					index_entry * const * d_next = d_first + 1;
+					while (d_next != d_last && (*d_next)->mode == de.mode && (*d_next)->cannon_name == de.cannon_name)
+						++d_next;
+
+					if (task.recurse)
+					{
+						status_task sub;
+						sub.path_prefix = current_path_prefix + (*d_first)->name + "/";
+						sub.name = current_name + (*d_first)->name + "/";
+						sub.dirs.assign(d_first, d_next);
+						sub.ign = ign_node;
+						sub.mtime.sec = de.mtime;
+						sub.mtime.nsec = de.mtime_nsec;
+						sub.uc = uc? find_untracked_subdir(uc, (*d_first)->name): 0;
+						sub.recurse = true;
+						sub.ignored = task.ignored || ign_node->match(sub.name);
+						subdirs.push_back(std::move(sub));
+					}
+
+					d_first = d_next - 1;
+				}
+				else
+				{
+					index_entry const & ie = **d_first;
+					if (!stat_matches(ie, de, ctx.index_mtime))
+					{
+						// Like git, we trust a changed size without looking at the content,
+						// unless the size was zeroed to mark the entry racily clean.
+						git_wd::file_status fs;
+						if (ie.size != 0 && ie.size != (uint32_t)de.size)
+						{
+							fs = git_wd::file_status::modified;
+						}
+						else
+						{
+							current_path_prefix.append(ie.name.data(), ie.name.size());
+							fs = check_file_status(current_path_prefix, ie.oid);
+							current_path_prefix.resize(path_prefix_len);
+
+							// The file could have changed again since it was listed
+							// only if it was modified after the walk started.
+							stat_time mtime = { de.mtime, de.mtime_nsec };
+							if (fs == git_wd::file_status::none && ctx.refresh && mtime < ctx.refresh_time)
+							{
+								refreshed_entry re = { ie.raw, mtime, (uint32_t)de.size };
+								refreshed.push_back(re);
+							}
+						}
+
+						if (fs != git_wd::file_status::none)
+						{
+							current_name.append(ie.name.data(), ie.name.size());
+							st.emplace_back(current_name, fs, false);
+							current_name.resize(name_len);
+						}
+					}
+				}
+			}
+			else
+			{
+				current_name.append((*d_first)->name.data(), (*d_first)->name.size());
+				st.emplace_back(current_name, git_wd::file_status::modified, is_dir((*d_first)->mode));
+				current_name.resize(name_len);
+			}
+
+			++d_first;
+		}
+		else
+		{
+			current_name.append(de.name);
+			if (!task.ignored && (cached || !ign_node->match(is_dir(de.mode)? current_name + "/": current_name)))
+				st.emplace_back(current_name, git_wd::file_status::added, is_dir(de.mode));
+			current_name.resize(name_len);
+		}
+	}
+
+	for (; d_first != d_last; ++d_first)
+	{
+		current_name.append((*d_first)->name.data(), (*d_first)->name.size());
+		st.emplace_back(current_name, git_wd::file_status::deleted, is_dir((*d_first)->mode));
+		current_name.resize(name_len);
+	}
+}
+
+// Whether the untracked cache agrees with how we find untracked files. We only read
+// .gitignore files, so the cache must have been written for this working tree,
+// without core.excludesFile and with the info/exclude we have now. It must also
+// list untracked directories rather than their content, and no ignored files.
+static bool untracked_cache_usable(untracked_cache const & uc, string_view path)
+{
+	if (!uc.present || uc.exclude_per_dir != ".gitignore" || uc.excludes_file_oid != object_id())
+		return false;
+
+	// DIR_SHOW_OTHER_DIRECTORIES, but not DIR_SHOW_IGNORED.
+	if ((uc.dir_flags & 3) != 2)
+		return false;
+
+	bool same_location = false;
+	for (string_view ident: uc.idents)
+	{
+		if (!starts_with(ident, "Location "))
+			continue;
+
+		string_view location = ident.substr(9, ident.rfind(',') - 9);
+		if (!location.empty() && cannonical_path(location) == cannonical_path(path))
+			same_location = true;
+	}
+
+	if (!same_location)
+		return false;
+
+	directory_entry de;
+	bool has_info_exclude = try_stat(path + "/.git/info/exclude", de);
+	if (has_info_exclude != (uc.info_exclude_oid != object_id()))
+		return false;
+
+	if (has_info_exclude)
+	{
+		if (de.mtime != uc.info_exclude_mtime.sec || (uint32_t)de.size != uc.info_exclude_size)
+			return false;
+		if (uc.info_exclude_mtime.nsec != 0 && de.mtime_nsec != uc.info_exclude_mtime.nsec)
+			return false;
+	}
+
+	return true;
+}
+
+// Where the walk reports what it found.
+typedef std::function<void (status_entry const & e)> status_report;
+
+// Sorts what `status_dir` found into the order it's reported in.
+static void sort_status_output(std::vector<status_entry> & st, std::vector<status_task> & subdirs)
+{
+	std::sort(st.begin(), st.end());
+	std::sort(subdirs.begin(), subdirs.end(), [](status_task const & lhs, status_task const & rhs) {
+		return lhs.name < rhs.name;
+	});
+}
+
+// Compares a directory and reports what changed in it, recursing
+// into each subdirectory where its content sorts.
+static void status_walk(status_task & task, status_context const & ctx, status_report const & report, std::vector<refreshed_entry> & refreshed)
+{
+	std::vector<status_entry> st;
+	std::vector<status_task> subdirs;
+	status_dir(task, ctx, st, refreshed, subdirs);
+	sort_status_output(st, subdirs);
+
+	auto sub_it = subdirs.begin();
+	for (status_entry const & e: st)
+	{
+		for (; sub_it != subdirs.end() && !precedes_subdir(e, *sub_it); ++sub_it)
+			status_walk(*sub_it, ctx, report, refreshed);
+		report(e);
+	}
+
+	for (; sub_it != subdirs.end(); ++sub_it)
+		status_walk(*sub_it, ctx, report, refreshed);
+}
+
+// A directory compared by the scheduler. What was found is kept until it's reported.
+struct status_node
+{
+	status_task task;
+	std::vector<status_entry> st;
+	std::vector<std::unique_ptr<status_node> > subdirs;
+	bool done;
+
+	explicit status_node(status_task && task)
+		: task(std::move(task)), done(false)
+	{
+	}
+};
+
+// Runs status tasks on a pool of threads. Each worker takes tasks from the back
+// of its own queue, so it goes depth-first like the recursive walk did,
+// and steals from the front of the others', where the larger subtrees tend to be.
+// The calling thread reports the results in order as the directories are done,
+// and works on tasks itself while the next one it needs isn't.
+class status_scheduler
+{
+public:
+	status_scheduler(status_context const & ctx, size_t thread_count)
+		: m_ctx(ctx), m_queued(0), m_pending(0), m_failed(false)
+	{
+		for (size_t i = 0; i < thread_count; ++i)
+			m_workers.emplace_back(new worker());
+	}
+
+	void run(std::vector<status_task> && tasks, status_report const & report)
+	{
+		if (tasks.empty())
+			return;
+
+		std::vector<std::unique_ptr<status_node> > roots;
+		for (status_task & task: tasks)
+		{
+			roots.emplace_back(new status_node(std::move(task)));
+			m_workers[0]->tasks.push_front(roots.back().get());
+		}
+		m_queued = roots.size();
+		m_pending = roots.size();
+
+		std::vector<std::thread> threads;
+		try
+		{
+			for (size_t i = 1; i < m_workers.size(); ++i)
+				threads.emplace_back(&status_scheduler::work, this, i);
+
+			for (auto && root: roots)
+				this->report_dir(*root, report);
+		}
+		catch (...)
+		{
+			this->fail(std::current_exception());
+		}
+
+		for (std::thread & t: threads)
+			t.join();
+
+		if (m_error)
+			std::rethrow_exception(m_error);
+	}
+
+	void merge(std::vector<refreshed_entry> & refreshed)
+	{
+		for (auto && w: m_workers)
+			refreshed.insert(refreshed.end(), w->refreshed.begin(), w->refreshed.end());
+	}
+
+private:
+	struct worker
+	{
+		std::mutex mutex;
+		std::deque<status_node *> tasks;
+		std::vector<refreshed_entry> refreshed;
+	};
+
+	bool pop(size_t self, status_node *& node)
+	{
+		{
+			worker & w = *m_workers[self];
+			std::lock_guard<std::mutex> l(w.mutex);
+			if (!w.tasks.empty())
+			{
+				node = w.tasks.back();
+				w.tasks.pop_back();
+				--m_queued;
+				return true;
+			}
+		}
+
+		for (size_t i = 1; i < m_workers.size(); ++i)
+		{
+			worker & w = *m_workers[(self + i) % m_workers.size()];
+			std::lock_guard<std::mutex> l(w.mutex);
+			if (!w.tasks.empty())
+			{
+				node = w.tasks.front();
+				w.tasks.pop_front();
+				--m_queued;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void process(size_t self, status_node & node)
+	{
+		worker & w = *m_workers[self];
+
+		std::vector<status_task> subdirs;
+		status_dir(node.task, m_ctx, node.st, w.refreshed, subdirs);
+		sort_status_output(node.st, subdirs);
+
+		for (status_task & sub: subdirs)
+			node.subdirs.emplace_back(new status_node(std::move(sub)));
+
+		// The first subdirectory is at the back, as it's reported first.
+		if (!node.subdirs.empty())
+		{
+			m_pending += node.subdirs.size();
+
+			std::lock_guard<std::mutex> l(w.mutex);
+			for (auto it = node.subdirs.rbegin(); it != node.subdirs.rend(); ++it)
+				w.tasks.push_back(it->get());
+			m_queued += node.subdirs.size();
+		}
+
+		// Whoever queues tasks or finishes one notifies the others while
+		// holding `m_mutex`, so the wakeup can't be missed.
+		std::lock_guard<std::mutex> l(m_mutex);
+		node.done = true;
+		--m_pending;
+		m_cv.notify_all();
+	}
+
+	void work(size_t self)
+	{
+		while (!m_failed)
+		{
+			status_node * node;
+			if (!this->pop(self, node))
+			{
+				std::unique_lock<std::mutex> l(m_mutex);
+				m_cv.wait(l, [this] { return m_queued != 0 || m_pending == 0 || m_failed; });
+				if (m_pending == 0)
+					return;
+				continue;
+			}
+
+			try
+			{
+				this->process(self, *node);
+			}
+			catch (...)
+			{
+				this->fail(std::current_exception());
+				return;
+			}
+		}
+	}
+
+	// Reports what was found in `node` and below, which is
+	// then freed, except for `node` itself.
+	void report_dir(status_node & node, status_report const & report)
+	{
+		this->wait(node);
+
+		auto sub_it = node.subdirs.begin();
+		for (status_entry const & e: node.st)
+		{
+			for (; sub_it != node.subdirs.end() && !precedes_subdir(e, (*sub_it)->task); ++sub_it)
+			{
+				this->report_dir(**sub_it, report);
+				sub_it->reset();
+			}
+			report(e);
+		}
+
+		for (; sub_it != node.subdirs.end(); ++sub_it)
+		{
+			this->report_dir(**sub_it, report);
+			sub_it->reset();
+		}
+	}
+
+	// Works on the queued tasks until `node` is done.
+	void wait(status_node & node)
+	{
+		for (;;)
+		{
+			{
+				std::lock_guard<std::mutex> l(m_mutex);
+				if (node.done)
+					return;
+				if (m_failed)
+					std::rethrow_exception(m_error);
+			}
+
+			status_node * task;
+			if (this->pop(0, task))
+			{
+				this->process(0, *task);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> l(m_mutex);
+			m_cv.wait(l, [this, &node] { return node.done || m_queued != 0 || m_failed; });
+		}
+	}
+
+	void fail(std::exception_ptr e)
+	{
+		std::lock_guard<std::mutex> l(m_mutex);
+		if (!m_failed)
+		{
+			m_error = e;
+			m_failed = true;
+		}
+		m_cv.notify_all();
+	}
+
+	status_context const & m_ctx;
+	std::vector<std::unique_ptr<worker> > m_workers;
+
+	// Tasks waiting in a queue, and tasks either waiting or running.
+	std::atomic<size_t> m_queued;
+	std::atomic<size_t> m_pending;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::atomic<bool> m_failed;
+	std::exception_ptr m_error;
+};
+
+// The result of the last status that used the fsmonitor, together with the
+// token the fsmonitor handed out before it and the index it was compared to.
+// The names of directories in the results end with a slash.
+struct fsmonitor_state
+{
+	std::string token;
+	object_id index_checksum;
+	git_wd::status_t results;
+};
+
+// The state is a header, the token and the checksum on separate lines, followed
+// by the results, each a status letter and a path, terminated by a NUL.
+static bool read_fsmonitor_state(std::string const & path, fsmonitor_state & state)
+{
+	file f;
+	if (!f.try_open(path, /*readonly=*/true))
+		return false;
+
+	std::string content;
+	content.resize((size_t)f.size());
+	file::ifile fi(f.seekg(0));
+	read_all(fi, (uint8_t *)&content[0], content.size());
+
+	string_view rest = content;
+	std::vector<string_view> header;
+	for (int i = 0; i != 3; ++i)
+	{
+		size_t line_end = rest.find('\n');
+		if (line_end == rest.size())
+			return false;
+
+		header.push_back(rest.substr(0, line_end));
+		rest = rest.substr(line_end + 1);
+	}
+
+	if (header[0] != "gh-fsmonitor 2" || header[2].size() != 40)
+		return false;
+
+	state.token = header[1];
+	state.index_checksum = object_id(header[2]);
+
+	while (!rest.empty())
+	{
+		size_t entry_end = rest.find('\0');
+		if (entry_end == rest.size() || entry_end < 2)
+			return false;
+
+		git_wd::file_status fs;
+		switch (rest[0])
+		{
+		case 'A':
+			fs = git_wd::file_status::added;
+			break;
+		case 'D':
+			fs = git_wd::file_status::deleted;
+			break;
+		case 'M':
+			fs = git_wd::file_status::modified;
+			break;
+		default:
+			return false;
+		}
+
+		state.results[rest.substr(1, entry_end - 1)] = fs;
+		rest = rest.substr(entry_end + 1);
+	}
+
+	return true;
+}
+
+static void write_fsmonitor_state(std::string const & path, fsmonitor_state const & state)
+{
+	std::string content = "gh-fsmonitor 2\n" + state.token + "\n" + state.index_checksum.base16() + "\n";
+	for (auto && kv: state.results)
+	{
+		content += "ADM"[static_cast<int>(kv.second)];
+		content += kv.first;
+		content += '\0';
+	}
+
+	// The state is only a cache, if someone else is writing it, they win.
+	lock_file lock(path);
+	if (!lock.try_lock())
+		return;
+
+	file::ofile fo = lock.get().seekp(0);
+	write_all(fo, (uint8_t const *)content.data(), content.size());
+	lock.commit();
+}
+
+// Finds the directories of the index named `name` in `dirs`. There may be
+// several, differing in case, like the ones `status_dir` merges.
+static std::vector<index_entry *> find_index_subdirs(std::vector<index_entry *> const & dirs, string_view name)
+{
+	std::string cname = cannonical_path(name);
+
+	std::vector<index_entry *> res;
+	for (index_entry * dir: dirs)
+	{
+		list_index_dir(*dir);
+		for (index_entry & ie: dir->children)
+		{
+			if (is_dir(ie.mode) && cannonical_path(ie.name) == cname)
+				res.push_back(&ie);
+		}
+	}
+	return res;
+}
+
+// A directory of the index that must be compared again.
+struct fsmonitor_dirty_dir
+{
+	std::string name;
+	std::vector<index_entry *> dirs;
+	bool recurse;
+};
+
+// The name of the directory containing `name`, with a trailing slash unless it's the root.
+static std::string parent_dir_name(string_view name)
+{
+	string_view path = name.rstrip('/');
+	size_t slash = path.rfind('/');
+	return slash == path.size()? std::string(): name.substr(0, slash + 1).to_string();
+}
+
+// Returns the ignore rules in effect inside the directory `name`, loading
+// its .gitignore and those of its parents unless they're in `loaded`.
+static std::shared_ptr<status_ignore const> ignore_rules_inside(std::string const & wd_path, std::string const & name, gitignore_cache & gitignores,
+	std::shared_ptr<status_ignore const> const & root_rules, std::map<std::string, std::shared_ptr<status_ignore const> > & loaded)
+{
+	auto it = loaded.find(name);
+	if (it != loaded.end())
+		return it->second;
 
-				p = n;
-			}
-			else
-			{
-				break;
-			}
-		}
+	std::shared_ptr<status_ignore const> res = name.empty()? root_rules: ignore_rules_inside(wd_path, parent_dir_name(name), gitignores, root_rules, loaded);
 
-		buffer.erase(buffer.begin(), buffer.begin() + (p - buffer.data()));
+	std::string path = wd_path + "/" + name + ".gitignore";
+	directory_entry de;
+	if (try_stat(path, de) && !is_dir(de.mode))
+	{
+		if (std::shared_ptr<cached_gitignore const> gitignore = gitignores.get(name, path, de))
+			res = add_ignore_rules(res, gitignore);
 	}
 
-	delete m_pimpl;
-	m_pimpl = pimpl.release();
+	loaded[name] = res;
+	return res;
 }
 
-git_wd::git_wd(git_wd && o)
-	: m_pimpl(o.m_pimpl)
+// Whether the directory `name` or one of its parents is ignored.
+static bool ignored_dir(std::string const & wd_path, std::string const & name, gitignore_cache & gitignores,
+	std::shared_ptr<status_ignore const> const & root_rules, std::map<std::string, std::shared_ptr<status_ignore const> > & loaded)
 {
-	o.m_pimpl = 0;
-}
+	for (size_t pos = name.find('/'); pos != std::string::npos; pos = name.find('/', pos + 1))
+	{
+		std::string dir = name.substr(0, pos + 1);
+		if (ignore_rules_inside(wd_path, parent_dir_name(dir), gitignores, root_rules, loaded)->match(dir))
+			return true;
+	}
 
-git_wd & git_wd::operator=(git_wd && o)
-{
-	std::swap(m_pimpl, o.m_pimpl);
-	return *this;
+	return false;
 }
 
-string_view git_wd::path() const
+// Turns the changes reported by the fsmonitor into tasks and drops the saved results
+// they will replace. A changed path makes the deepest directory of the index
+// containing it dirty. Directories that were created or renamed into place
+// are compared whole, since no change is reported for their content. Directories
+// that were deleted or renamed away take all the saved results inside them along.
+static void plan_fsmonitor_tasks(std::string const & wd_path, index_entry & root, git_ignore const & ign, gitignore_cache & gitignores,
+	std::vector<fsmonitor_change> const & changes, git_wd::status_t & results, std::vector<status_task> & tasks)
 {
-	return m_pimpl->m_path;
-}
+	// Keyed by the canonical name of the directory.
+	std::map<std::string, fsmonitor_dirty_dir> dirty;
+	auto add_dirty = [&](fsmonitor_dirty_dir && dd) {
+		fsmonitor_dirty_dir & cur = dirty[dd.name.empty()? std::string(): cannonical_path(dd.name)];
+		if (cur.dirs.empty())
+			cur = std::move(dd);
+		else if (dd.recurse)
+			cur.recurse = true;
+	};
 
-#include "checkout_filter.h"
+	// The canonical names of the directories of the index that are gone.
+	std::set<std::string> gone;
 
-static git_wd::file_status check_file_status(string_view fname, object_id const & expected_oid)
-{
-	file fin;
-	if (fin.try_open(fname, /*readonly=*/true))
+	for (fsmonitor_change const & ch: changes)
 	{
-		file_offset_t size;
+		std::vector<string_view> comps = string_view(ch.path).split('/');
 
+		fsmonitor_dirty_dir dd;
+		dd.dirs.push_back(&root);
+		dd.recurse = false;
+
+		size_t i = 0;
+		for (; i + 1 < comps.size(); ++i)
 		{
-			file::ifile fi(fin.seekg(0));
-			checkin_filter cf(fi);
-			size = stream_size(cf);
+			std::vector<index_entry *> subdirs = find_index_subdirs(dd.dirs, comps[i]);
+			if (subdirs.empty())
+				break;
+
+			dd.name.append(subdirs[0]->name.data(), subdirs[0]->name.size());
+			dd.name.append("/");
+			dd.dirs = std::move(subdirs);
 		}
 
-		file::ifile fi(fin.seekg(0));
-		checkin_filter cf(fi);
+		if (i + 1 == comps.size() && ch.created)
+		{
+			fsmonitor_dirty_dir created;
+			created.dirs = find_index_subdirs(dd.dirs, comps.back());
+			if (!created.dirs.empty())
+			{
+				created.name = dd.name + created.dirs[0]->name + "/";
+				created.recurse = true;
+				add_dirty(std::move(created));
+			}
+		}
+		else if (i + 1 == comps.size())
+		{
+			// If it's back, it was created again and is compared whole.
+			std::vector<index_entry *> subdirs = find_index_subdirs(dd.dirs, comps.back());
+			if (!subdirs.empty())
+			{
+				std::string name = dd.name + subdirs[0]->name + "/";
+				if (!file::is_directory(wd_path + "/" + name))
+					gone.insert(cannonical_path(name));
+			}
+		}
 
-		if (sha1(gitdb::object_type::blob, size, cf) != expected_oid)
-			return git_wd::file_status::modified;
+		add_dirty(std::move(dd));
 	}
-	else
+
+	// Whether a path is inside a directory that's compared whole.
+	auto covered = [&](std::string const & key) {
+		for (size_t pos = key.find('/'); pos != std::string::npos && pos + 1 < key.size(); pos = key.find('/', pos + 1))
+		{
+			auto it = dirty.find(key.substr(0, pos + 1));
+			if (it != dirty.end() && it->second.recurse)
+				return true;
+		}
+		return false;
+	};
+
+	// Whether a path is inside a directory that's gone; the directory itself is
+	// reported by its parent.
+	auto inside_gone = [&](std::string const & key) {
+		for (size_t pos = key.find('/'); pos != std::string::npos && pos + 1 < key.size(); pos = key.find('/', pos + 1))
+		{
+			if (gone.count(key.substr(0, pos + 1)))
+				return true;
+		}
+		return false;
+	};
+
+	for (auto it = results.begin(); it != results.end();)
 	{
-		return git_wd::file_status::deleted;
+		std::string key = cannonical_path(it->first);
+		if (dirty.count(parent_dir_name(key)) || covered(key) || inside_gone(key))
+			it = results.erase(it);
+		else
+			++it;
 	}
 
-	return git_wd::file_status::none;
-}
-
-static int compare_tree_objects(string_view lname, bool is_ldir, string_view rname, bool is_rdir)
-{
-	size_t clen = (std::min)(lname.size(), rname.size());
-	int r = memcmp(lname.data(), rname.data(), clen);
-	if (r != 0)
-		return r;
+	std::shared_ptr<status_ignore const> root_rules = root_ignore_rules(ign);
+	std::map<std::string, std::shared_ptr<status_ignore const> > loaded;
 
-	return (lname.size() == clen? (is_ldir? '/': 0): lname[clen])
-		- (rname.size() == clen? (is_rdir? '/': 0): rname[clen]);
-}
+	for (auto && kv: dirty)
+	{
+		fsmonitor_dirty_dir & dd = kv.second;
 
-static bool is_file(uint32_t mode)
-{
-	return (mode & 0xe000) == 0x8000;
-}
+		// Directories that are gone are reported by their parent.
+		std::string path_prefix = wd_path + "/" + dd.name;
+		if (covered(kv.first) || (!dd.name.empty() && !file::is_directory(path_prefix)))
+			continue;
 
-static bool is_dir(uint32_t mode)
-{
-	return (mode & 0xe000) == 0x4000;
+		status_task task;
+		task.path_prefix = path_prefix;
+		task.name = dd.name;
+		task.dirs = std::move(dd.dirs);
+		task.ign = dd.name.empty()? root_rules: ignore_rules_inside(wd_path, parent_dir_name(dd.name), gitignores, root_rules, loaded);
+		task.mtime.sec = 0;
+		task.mtime.nsec = 0;
+		task.uc = 0;
+		task.recurse = dd.recurse;
+		task.ignored = ignored_dir(wd_path, dd.name, gitignores, root_rules, loaded);
+		tasks.push_back(std::move(task));
+	}
 }
 
-static bool is_gitlink(uint32_t mode)
+void git_wd::status(status_t & st, git_ignore const & ign, status_options const & opts)
 {
-	return (mode & 0xe000) == 0xe000;
+	this->status([&st](string_view name, file_status fs) {
+		st[name] = fs;
+	}, ign, opts);
 }
 
-static bool cannon_less(index_entry const & lhs, index_entry const & rhs)
+void git_wd::status(status_callback const & cb, git_ignore const & ign, status_options const & opts)
 {
-	int r = cmp(lhs.cannon_name, rhs.cannon_name);
-	if (r == 0)
-		return lhs.mode < rhs.mode;
-	return r < 0;
-}
+	assert(!m_pimpl->m_path.empty());
 
-// We expect index entries here to be sorted using `compare_filenames` and then by `mode`.
-static void status_dir(std::map<std::string, git_wd::file_status> & st, std::string & current_path_prefix, std::string & current_name, std::vector<index_entry const *> const & d, git_ignore const & parent_ign)
-{
-	git_ignore ign(&parent_ign);
+	status_context ctx;
+	ctx.index_mtime = m_pimpl->m_index_mtime;
+	ctx.refresh = false;
+	ctx.gitignores = m_pimpl->m_gitignores.get();
 
+	// The lock keeps others from writing the index while we walk, and its
+	// timestamp tells us which files may have changed since we listed them.
+	// If someone else holds it, we don't refresh this time.
+	lock_file lock(m_pimpl->m_path + "/.git/index");
+	if (opts.refresh_index && !m_pimpl->m_split_index && lock.try_lock())
 	{
-		file fign;
-		if (fign.try_open(current_path_prefix + "/.gitignore", /*readonly=*/true))
-		{
-			file::ifile fi(fign.seekg(0));
-			ign.load(current_name, fi);
-		}
+		lock.get().mtime(ctx.refresh_time.sec, ctx.refresh_time.nsec);
+		ctx.refresh = true;
 	}
 
-	auto dir_content = listdir(current_path_prefix);
-	std::sort(dir_content.begin(), dir_content.end(), [](directory_entry const & lhs, directory_entry const & rhs) {
-		return lhs.cannon_name < rhs.cannon_name;
-	});
-
-	// There won't be duplicates (relative to `compare_filenames`) in `dir_content`, but
-	// there might be duplicates in `d` (e.g. "File" and "file" are distinct according
-	// to git's basename ordering, but are the same according to the Windows'
-	// case-insensitive ordering.
-
-	size_t path_prefix_len = current_path_prefix.size();
-	size_t name_len = current_name.size();
+	// The fsmonitor is asked before the walk, so that whatever changes
+	// while we walk will be reported the next time. The saved result
+	// can't be used if the index changed or any ignore rules did.
+	std::string fsmonitor_state_path = m_pimpl->m_path + "/.git/gh-fsmonitor";
+	fsmonitor_state fsm;
+	bool has_fsmonitor = false;
+	bool incremental = false;
 
-	index_entry const * const * d_first = d.data();
-	index_entry const * const * d_last = d.data() + d.size();
-
-	for (directory_entry const & de: dir_content)
+	std::vector<status_task> tasks;
+	if (opts.use_fsmonitor)
 	{
-		int r = d_first == d_last? 1: cmp((*d_first)->cannon_name, de.cannon_name);
+		fsmonitor_state saved;
+		bool has_saved = read_fsmonitor_state(fsmonitor_state_path, saved);
+
+		bool complete;
+		std::vector<fsmonitor_change> changes;
+		has_fsmonitor = fsmonitor_query(m_pimpl->m_path, has_saved? saved.token: std::string(), fsm.token, complete, changes);
 
-		for (; r < 0; ++d_first)
+		incremental = has_fsmonitor && has_saved && complete && saved.index_checksum == object_id(m_pimpl->m_index_last);
+		for (size_t i = 0; incremental && i != changes.size(); ++i)
 		{
-			current_name.append((*d_first)->name);
-			st[current_name] = git_wd::file_status::deleted;
-			current_name.resize(name_len);
+			if (cannonical_path(path_tail(changes[i].path)) == cannonical_path(".gitignore"))
+				incremental = false;
+		}
 
-			r = d_first == d_last? 1: cmp((*d_first)->cannon_name, de.cannon_name);
+		if (incremental)
+		{
+			fsm.results = std::move(saved.results);
+			plan_fsmonitor_tasks(m_pimpl->m_path, m_pimpl->m_root, ign, *m_pimpl->m_gitignores, changes, fsm.results, tasks);
 		}
+	}
 
-		if (r == 0)
+	if (!incremental)
+	{
+		status_task root;
+		root.path_prefix = m_pimpl->m_path + "/";
+		root.dirs.push_back(&m_pimpl->m_root);
+		root.ign = root_ignore_rules(ign);
+		root.mtime.sec = 0;
+		root.mtime.nsec = 0;
+		root.uc = 0;
+		root.recurse = true;
+		root.ignored = false;
+
+		directory_entry root_de;
+		if (untracked_cache_usable(m_pimpl->m_untracked_cache, m_pimpl->m_path) && try_stat(m_pimpl->m_path, root_de))
 		{
-			// Note that we can't tell if something is a symlink on Windows,
-			// so we need to filter that bit out.
-			if ((de.mode & 0xc000) == ((*d_first)->mode & 0xc000))
-			{
-				if (is_gitlink(de.mode))
-				{
-					// XXX
-				}
-				else if (is_dir(de.mode))
-				{
-					// We search for the equal range in `d` here, since we'll have to merge
-					// all the distinct directories together.
-					index_entry const * const * d_next = d_first + 1;
-					while (d_next != d_last && (*d_next)->mode == de.mode && (*d_next)->cannon_name == de.cannon_name)
-						++d_next;
+			root.mtime.sec = root_de.mtime;
+			root.mtime.nsec = root_de.mtime_nsec;
+			root.uc = &m_pimpl->m_untracked_cache.root;
+		}
 
-					std::vector<index_entry const *> nested_entries;
+		tasks.push_back(std::move(root));
+	}
 
-					for (index_entry const * const * cur = d_first; cur != d_next; ++cur)
-					{
-						for (index_entry const & ie: (*cur)->children)
-							nested_entries.push_back(&ie);
-					}
+	// With the fsmonitor, everything found is saved for the next time, and
+	// only reported once the walk is done. Directories are keyed with
+	// a trailing slash, so that they sort in the order they're reported.
+	status_report report;
+	if (has_fsmonitor)
+	{
+		report = [&fsm](status_entry const & e) {
+			fsm.results[e.dir? e.name + "/": e.name] = e.status;
+		};
+	}
+	else
+	{
+		report = [&cb](status_entry const & e) {
+			cb(e.name, e.status);
+		};
+	}
 
-					std::stable_sort(nested_entries.begin(), nested_entries.end(), [](index_entry const * lhs, index_entry const * rhs) {
-						return cannon_less(*lhs, *rhs);
-					});
+	std::vector<refreshed_entry> refreshed;
 
-					current_name.append((*d_first)->name);
-					current_name.append("/");
-					current_path_prefix.append((*d_first)->name);
-					current_path_prefix.append("/");
-					status_dir(st, current_path_prefix, current_name, nested_entries, ign);
-					current_path_prefix.resize(path_prefix_len);
-					current_name.resize(name_len);
+	size_t thread_count = opts.thread_count;
+	if (thread_count == 0)
+		thread_count = (std::max)(std::thread::hardware_concurrency(), 1u);
 
-					d_first = d_next - 1;
-				}
-				else
-				{
-					if ((*d_first)->mtime != de.mtime)
-					{
-						current_path_prefix.append((*d_first)->name);
-						git_wd::file_status fs = check_file_status(current_path_prefix, (*d_first)->oid);
-						if (fs != git_wd::file_status::none)
-						{
-							current_name.append((*d_first)->name);
-							st[current_name] = fs;
-							current_name.resize(name_len);
-						}
-						current_path_prefix.resize(path_prefix_len);
-					}
-				}
-			}
-			else
-			{
-				current_name.append((*d_first)->name);
-				st[current_name] = git_wd::file_status::modified;
-				current_name.resize(name_len);
-			}
+	if (thread_count == 1)
+	{
+		for (status_task & task: tasks)
+			status_walk(task, ctx, report, refreshed);
+	}
+	else
+	{
+		status_scheduler sched(ctx, thread_count);
+		sched.run(std::move(tasks), report);
+		sched.merge(refreshed);
+	}
 
-			++d_first;
-		}
-		else
-		{
-			current_name.append(de.name);
-			if (!ign.match(is_dir(de.mode)? current_name + "/": current_name))
-				st[current_name] = git_wd::file_status::added;
-			current_name.resize(name_len);
-		}
+	if (has_fsmonitor)
+	{
+		for (auto && kv: fsm.results)
+			cb(string_view(kv.first).rstrip('/'), kv.second);
 	}
 
-	for (; d_first != d_last; ++d_first)
+	if (!refreshed.empty())
 	{
-		current_name.append((*d_first)->name);
-		st[current_name] = git_wd::file_status::deleted;
-		current_name.resize(name_len);
+		std::sort(refreshed.begin(), refreshed.end(), [](refreshed_entry const & lhs, refreshed_entry const & rhs) {
+			return lhs.raw < rhs.raw;
+		});
+		m_pimpl->write_index(lock.get(), refreshed);
+		lock.commit();
+
+		// Read back the index we've just written.
+		std::string path = m_pimpl->m_path;
+		this->open(*m_pimpl->m_db, path);
+	}
+
+	if (has_fsmonitor)
+	{
+		fsm.index_checksum = object_id(m_pimpl->m_index_last);
+		write_fsmonitor_state(fsmonitor_state_path, fsm);
 	}
 }
 
-void git_wd::status(std::map<std::string, file_status> & st, git_ignore const & ign)
+// Writes the index back with refreshed stat data, which must be sorted
+// by the entries' position in the index. Any other entry that
+// is racily clean gets its size zeroed, as the new index will be newer
+// than the entry and would otherwise vouch for it.
+void git_wd::impl::write_index(file & f, std::vector<refreshed_entry> const & refreshed)
 {
-	assert(!m_pimpl->m_path.empty());
+	std::vector<uint8_t> buf(m_index_first, m_index_last);
+
+	auto refreshed_it = refreshed.begin();
+	for (uint8_t const * raw: m_entries)
+	{
+		uint8_t * p = buf.data() + (raw - m_index_first);
+
+		if (refreshed_it != refreshed.end() && refreshed_it->raw == raw)
+		{
+			store_be<uint32_t>(p + 8, refreshed_it->mtime.sec);
+			store_be<uint32_t>(p + 12, refreshed_it->mtime.nsec);
+			store_be<uint32_t>(p + 36, refreshed_it->size);
+			++refreshed_it;
+			continue;
+		}
 
-	std::string current_path = m_pimpl->m_path + "/";
-	std::string current_name;
+		stat_time mtime = { load_be<uint32_t>(p + 8), load_be<uint32_t>(p + 12) };
+		if (is_racy(mtime, m_index_mtime))
+			store_be<uint32_t>(p + 36, 0);
+	}
 
-	std::vector<index_entry const *> root_entries;
-	root_entries.reserve(m_pimpl->m_root.size());
-	for (index_entry const & ie: m_pimpl->m_root)
-		root_entries.push_back(&ie);
-	std::stable_sort(root_entries.begin(), root_entries.end(), [](index_entry const * lhs, index_entry const * rhs) {
-		return cannon_less(*lhs, *rhs);
-	});
+	// Git regenerates the untracked cache if it's missing.
+	if (m_untracked_cache.racy)
+	{
+		buf.erase(
+			buf.begin() + (m_untracked_cache.ext_first - m_index_first),
+			buf.begin() + (m_untracked_cache.ext_last - m_index_first));
+	}
+
+	sha1_state ss;
+	ss.add(buf.data(), buf.data() + buf.size());
 
-	git_ignore ign_copy(ign);
-	status_dir(st, current_path, current_name, root_entries, ign_copy);
+	uint8_t hash[20];
+	ss.finish(hash);
+	buf.insert(buf.end(), hash, hash + 20);
+
+	file::ofile fo = f.seekp(0);
+	write_all(fo, buf.data(), buf.size());
 }
 
-object_id sha1(gitdb::object_type type, file_offset_t size, istream & s)
+static void add_object_header(sha1_state & ss, gitdb::object_type type, file_offset_t size)
 {
 	char const * obj_type_names[] =
 	{
@@ -1026,14 +4085,18 @@ object_id sha1(gitdb::object_type type, file_offset_t size, istream & s)
 		"tag",
 	};
 
-	sha1_state ss;
 	ss.add(obj_type_names[static_cast<int>(type)]);
 	ss.add(" ");
 
-	char buf[16];
-	int r = sprintf(buf, "%d", (size_t)size);
+	char buf[24];
+	int r = sprintf(buf, "%llu", (unsigned long long)size);
 	ss.add(string_view(buf, buf + r + 1));
+}
 
+object_id sha1(gitdb::object_type type, file_offset_t size, istream & s)
+{
+	sha1_state ss;
+	add_object_header(ss, type, size);
 	ss.add(s);
 
 	uint8_t hash[20];
@@ -1046,13 +4109,118 @@ object_id sha1(gitdb::object obj)
 	return sha1(obj.type, obj.size, *obj.content);
 }
 
-void tree_status_impl(git_wd::status_t & st, gitdb & db, git_wd::stage_tree const & stree, std::string & path_prefix, object_id const & stree_oid, object_id const & tree_oid)
+static void append_tree_entry(std::vector<uint8_t> & tree_obj, uint32_t mode, string_view name, object_id const & oid)
+{
+	char mode_buf[32];
+	char * buf_end = mode_buf;
+	while (mode != 0)
+	{
+		static char const digits[] = "01234567";
+		*buf_end++ = digits[mode & 0x7];
+		mode >>= 3;
+	}
+
+	size_t entry_len = name.size() + 22 + (buf_end - mode_buf);
+	tree_obj.resize(tree_obj.size() + entry_len);
+
+	uint8_t * entry_start = tree_obj.data() + (tree_obj.size() - entry_len);
+
+	while (buf_end != mode_buf)
+		*entry_start++ = *--buf_end;
+	*entry_start++ = ' ';
+
+	std::copy(name.begin(), name.end(), entry_start);
+	entry_start += name.size();
+	*entry_start++ = 0;
+
+	std::copy(oid.begin(), oid.end(), entry_start);
+}
+
+static void collect_invalid_trees(std::vector<std::vector<index_entry *> > & levels, index_entry & dir, size_t depth)
+{
+	list_index_dir(dir);
+
+	if (levels.size() <= depth)
+		levels.resize(depth + 1);
+	levels[depth].push_back(&dir);
+
+	for (index_entry & ie: dir.children)
+	{
+		if (is_dir(ie.mode) && !ie.tree_valid)
+			collect_invalid_trees(levels, ie, depth + 1);
+	}
+}
+
+// Serializes the tree of an index directory, whose subdirectories' oids must be
+// known, preceded by the object header. The header is written into the space
+// reserved in front of the entries once their size is known.
+static string_view serialize_index_tree(std::vector<uint8_t> & buf, index_entry const & dir)
+{
+	size_t const header_space = 32;
+
+	size_t obj_size_approx = header_space;
+	for (index_entry const & ie: dir.children)
+		obj_size_approx += ie.name.size() + 28;
+
+	buf.clear();
+	buf.reserve(obj_size_approx);
+	buf.resize(header_space);
+	for (index_entry const & ie: dir.children)
+		append_tree_entry(buf, ie.mode, ie.name, ie.oid);
+
+	char header[header_space];
+	int r = sprintf(header, "tree %llu", (unsigned long long)(buf.size() - header_space));
+
+	uint8_t * first = buf.data() + header_space - (r + 1);
+	std::copy(header, header + r + 1, first);
+	return string_view((char const *)first, (char const *)buf.data() + buf.size());
+}
+
+// Returns the oid of the tree for an index directory. Only directories
+// the cache tree doesn't cover are serialized and hashed. They're hashed
+// a level at a time, deepest first, so that `sha1_many` gets them in batches.
+static object_id const & index_tree_oid(index_entry & dir)
+{
+	if (dir.tree_valid)
+		return dir.oid;
+
+	std::vector<std::vector<index_entry *> > levels;
+	collect_invalid_trees(levels, dir, 0);
+
+	std::vector<std::vector<uint8_t> > tree_objs;
+	std::vector<string_view> messages;
+	std::vector<uint8_t> hashes;
+	for (auto it = levels.rbegin(); it != levels.rend(); ++it)
+	{
+		std::vector<index_entry *> const & level = *it;
+
+		tree_objs.resize(level.size());
+		messages.resize(level.size());
+		for (size_t i = 0; i != level.size(); ++i)
+			messages[i] = serialize_index_tree(tree_objs[i], *level[i]);
+
+		hashes.resize(20 * level.size());
+		sha1_many(hashes.data(), messages.data(), messages.size());
+
+		for (size_t i = 0; i != level.size(); ++i)
+		{
+			level[i]->oid = object_id(hashes.data() + 20 * i);
+			level[i]->tree_valid = true;
+		}
+	}
+
+	return dir.oid;
+}
+
+static void tree_status_impl(git_wd::status_callback const & cb, gitdb & db, index_entry & stage_dir, std::string & path_prefix, object_id const & tree_oid)
 {
-	gitdb::tree_t const & db_tree = db.get_tree(tree_oid);
-	gitdb::tree_t const & stage_tree = stree.trees.find(stree_oid)->second;
+	gitdb::tree_view db_tree = db.get_tree_view(tree_oid);
 
-	gitdb::tree_t::const_iterator db_it = db_tree.begin();
-	gitdb::tree_t::const_iterator stage_it = stage_tree.begin();
+	list_index_dir(stage_dir);
+	std::vector<index_entry> & stage_tree = stage_dir.children;
+
+	gitdb::tree_view::iterator db_it = db_tree.begin();
+	std::vector<index_entry>::iterator stage_it = stage_tree.begin();
 
 	size_t path_prefix_len = path_prefix.size();
 
@@ -1062,8 +4230,8 @@ void tree_status_impl(git_wd::status_t & st, gitdb & db, git_wd::stage_tree cons
 
 		while (r < 0)
 		{
-			path_prefix.append(stage_it->name);
-			st[path_prefix] = git_wd::file_status::added;
+			path_prefix.append(stage_it->name.data(), stage_it->name.size());
+			cb(path_prefix, git_wd::file_status::added);
 			path_prefix.resize(path_prefix_len);
 			++stage_it;
 			r = stage_it == stage_tree.end()? 1: compare_tree_objects(stage_it->name, is_dir(stage_it->mode), db_it->name, is_dir(db_it->mode));
@@ -1072,17 +4240,17 @@ void tree_status_impl(git_wd::status_t & st, gitdb & db, git_wd::stage_tree cons
 		if (r == 0)
 		{
 			if (stage_it->mode != db_it->mode
-				|| (is_file(stage_it->mode) && stage_it->oid != db_it->oid))
+				|| (is_file(stage_it->mode) && stage_it->oid != object_id(db_it->oid)))
 			{
-				path_prefix.append(stage_it->name);
-				st[path_prefix] = git_wd::file_status::modified;
+				path_prefix.append(stage_it->name.data(), stage_it->name.size());
+				cb(path_prefix, git_wd::file_status::modified);
 				path_prefix.resize(path_prefix_len);
 			}
-			else if (is_dir(stage_it->mode) && stage_it->oid != db_it->oid)
+			else if (is_dir(stage_it->mode) && index_tree_oid(*stage_it) != object_id(db_it->oid))
 			{
-				path_prefix.append(stage_it->name);
+				path_prefix.append(stage_it->name.data(), stage_it->name.size());
 				path_prefix.append("/");
-				tree_status_impl(st, db, stree, path_prefix, stage_it->oid, db_it->oid);
+				tree_status_impl(cb, db, *stage_it, path_prefix, db_it->oid);
 				path_prefix.resize(path_prefix_len);
 			}
 
@@ -1090,8 +4258,8 @@ void tree_status_impl(git_wd::status_t & st, gitdb & db, git_wd::stage_tree cons
 		}
 		else
 		{
-			path_prefix.append(db_it->name);
-			st[path_prefix] = git_wd::file_status::deleted;
+			path_prefix.append(db_it->name.data(), db_it->name.size());
+			cb(path_prefix, git_wd::file_status::deleted);
 			path_prefix.resize(path_prefix_len);
 		}
 
@@ -1100,102 +4268,66 @@ void tree_status_impl(git_wd::status_t & st, gitdb & db, git_wd::stage_tree cons
 
 	for (; stage_it != stage_tree.end(); ++stage_it)
 	{
-		path_prefix.append(stage_it->name);
-		st[path_prefix] = git_wd::file_status::added;
+		path_prefix.append(stage_it->name.data(), stage_it->name.size());
+		cb(path_prefix, git_wd::file_status::added);
 		path_prefix.resize(path_prefix_len);
 	}
 }
 
-void git_wd::tree_status(status_t & st, object_id const & tree_oid)
+void git_wd::tree_status(status_callback const & cb, object_id const & tree_oid)
 {
-	git_wd::stage_tree stage_tree;
-	this->make_stage_tree(stage_tree);
-
-	if (stage_tree.root_tree != tree_oid)
+	if (index_tree_oid(m_pimpl->m_root) != tree_oid)
 	{
 		std::string path_prefix;
-		tree_status_impl(st, *m_pimpl->m_db, stage_tree, path_prefix, stage_tree.root_tree, tree_oid);
+		tree_status_impl(cb, *m_pimpl->m_db, m_pimpl->m_root, path_prefix, tree_oid);
 	}
 }
 
-void git_wd::commit_status(status_t & st, object_id const & commit_oid)
+void git_wd::commit_status(status_callback const & cb, object_id const & commit_oid)
 {
 	gitdb::commit_t c = m_pimpl->m_db->get_commit(commit_oid);
-	this->tree_status(st, c.tree_oid);
+	this->tree_status(cb, c.tree_oid);
 }
 
-static object_id make_stage_tree_impl(git_wd::stage_tree & st, std::vector<index_entry> const & d)
+void git_wd::tree_status(status_t & st, object_id const & tree_oid)
 {
-	std::vector<gitdb::tree_entry_t> tree;
-	tree.reserve(d.size());
-
-	for (auto && ie: d)
-	{
-		if (is_dir(ie.mode))
-		{
-			gitdb::tree_entry_t te;
-			te.name = ie.name;
-			te.mode = 0x4000;
-			te.oid = make_stage_tree_impl(st, ie.children);
-			tree.push_back(te);
-		}
-		else
-		{
-			gitdb::tree_entry_t te;
-			te.name = ie.name;
-			te.mode = ie.mode;
-			te.oid = ie.oid;
-			tree.push_back(te);
-		}
-	}
-
-	size_t obj_size_approx = 0;
-	for (gitdb::tree_entry_t const & te : tree)
-		obj_size_approx += te.name.size() + 28;
-
-	std::vector<uint8_t> tree_obj;
-	tree_obj.reserve(obj_size_approx);
-	for (gitdb::tree_entry_t const & te: tree)
-	{
-		char mode_buf[32];
-		char * buf_end = mode_buf;
-		uint32_t mode = te.mode;
-		while (mode != 0)
-		{
-			static char const digits[] = "01234567";
-			*buf_end++ = digits[mode & 0x7];
-			mode >>= 3;
-		}
+	this->tree_status([&st](string_view name, file_status fs) {
+		st[name] = fs;
+	}, tree_oid);
+}
 
-		size_t entry_len = te.name.size() + 22 + (buf_end - mode_buf);
-		tree_obj.resize(tree_obj.size() + entry_len);
+void git_wd::commit_status(status_t & st, object_id const & commit_oid)
+{
+	this->tree_status(st, m_pimpl->m_db->get_commit(commit_oid).tree_oid);
+}
 
-		uint8_t * entry_start = tree_obj.data() + (tree_obj.size() - entry_len);
+static void make_stage_tree_impl(git_wd::stage_tree & st, index_entry & dir)
+{
+	list_index_dir(dir);
 
-		while (buf_end != mode_buf)
-			*entry_start++ = *--buf_end;
-		*entry_start++ = ' ';
+	std::vector<gitdb::tree_entry_t> tree;
+	tree.reserve(dir.children.size());
 
-		std::copy(te.name.begin(), te.name.end(), entry_start);
-		entry_start += te.name.size();
-		*entry_start++ = 0;
+	for (auto && ie: dir.children)
+	{
+		if (is_dir(ie.mode))
+			make_stage_tree_impl(st, ie);
 
-		std::copy(te.oid.begin(), te.oid.end(), entry_start);
+		gitdb::tree_entry_t te;
+		te.name = ie.name;
+		te.mode = ie.mode;
+		te.oid = ie.oid;
+		tree.push_back(std::move(te));
 	}
 
-	gitdb::object obj;
-	obj.type = gitdb::object_type::tree;
-	obj.size = tree_obj.size();
-	obj.content = std::make_shared<mem_istream>(tree_obj.data(), tree_obj.data() + tree_obj.size());
-
-	object_id oid = sha1(obj);
-	st.trees[oid] = std::move(tree);
-	return oid;
+	st.trees[index_tree_oid(dir)] = std::move(tree);
 }
 
 void git_wd::make_stage_tree(stage_tree & st)
 {
-	st.root_tree = make_stage_tree_impl(st, m_pimpl->m_root);
+	// Hashes all the trees first, a level at a time.
+	st.root_tree = index_tree_oid(m_pimpl->m_root);
+	make_stage_tree_impl(st, m_pimpl->m_root);
 }
 
 std::string git_wd::os_path_to_repo_path(string_view os_path)
@@ -6,6 +6,7 @@
 #include "stream.h"
 #include "ignore.h"
 #include <memory>
+#include <functional>
 #include <vector>
 #include <map>
 #include <stdint.h>
@@ -66,6 +67,104 @@ public:
 
 	typedef std::vector<tree_entry_t> tree_t;
 
+	// Iterates over the entries of a raw tree object without copying them.
+	class tree_view
+	{
+	public:
+		struct entry
+		{
+			uint32_t mode;
+			string_view name;
+			uint8_t const * oid;
+		};
+
+		class iterator
+		{
+		public:
+			iterator(uint8_t const * p, uint8_t const * last);
+
+			entry const & operator*() const;
+			entry const * operator->() const;
+			iterator & operator++();
+
+			bool operator==(iterator const & rhs) const
+			{
+				return m_p == rhs.m_p;
+			}
+
+			bool operator!=(iterator const & rhs) const
+			{
+				return !(*this == rhs);
+			}
+
+		private:
+			uint8_t const * m_p;
+			uint8_t const * m_next;
+			uint8_t const * m_last;
+			entry m_entry;
+
+			void parse();
+		};
+
+		tree_view();
+		explicit tree_view(std::shared_ptr<std::vector<uint8_t> const> content);
+
+		iterator begin() const;
+		iterator end() const;
+
+	private:
+		std::shared_ptr<std::vector<uint8_t> const> m_content;
+	};
+
+	// A commit as recorded in the commit-graph. Positions index the commits
+	// in the graph and can be passed back to `get_commit_graph_entry_at`.
+	struct commit_graph_entry
+	{
+		uint32_t pos;
+		object_id oid;
+		object_id tree_oid;
+		std::vector<uint32_t> parent_positions;
+		uint32_t generation;
+		uint64_t commit_time;
+	};
+
+	// A set of objects from the pack that carries reachability bitmaps,
+	// with one bit per object in the order the objects are stored in the pack.
+	class object_bitmap
+	{
+	public:
+		object_bitmap();
+		explicit object_bitmap(size_t size);
+		object_bitmap(size_t size, std::vector<uint64_t> && words);
+
+		size_t size() const;
+		size_t count() const;
+		bool test(size_t pos) const;
+		void set(size_t pos);
+
+		object_bitmap & operator|=(object_bitmap const & rhs);
+		object_bitmap & operator&=(object_bitmap const & rhs);
+		object_bitmap & operator-=(object_bitmap const & rhs);
+
+	private:
+		std::vector<uint64_t> m_words;
+		size_t m_size;
+	};
+
+	struct cache_stats
+	{
+		size_t hits;
+		size_t misses;
+	};
+
+	// Controls whether loose objects are checked against their name as they are read.
+	enum class verify_policy
+	{
+		never,
+		sampled,
+		always,
+	};
+
 	gitdb();
 	gitdb(gitdb && o);
 	~gitdb();
@@ -76,17 +175,33 @@ public:
 
 	std::vector<uint8_t> get_object_content(object_id oid, object_type req_type = object_type::none);
 	object get_object(object_id oid);
+	bool has_object(object_id oid);
 	std::shared_ptr<istream> get_object_stream(object_id oid, object_type req_type = object_type::none);
 
 	commit_t get_commit(object_id oid);
+	bool get_commit_graph_entry(object_id oid, commit_graph_entry & entry);
+	bool get_commit_graph_entry_at(uint32_t pos, commit_graph_entry & entry);
 	tree_t get_tree(object_id oid);
+	tree_view get_tree_view(object_id oid);
 
 	std::vector<uint8_t> get_blob(object_id oid);
 	std::shared_ptr<istream> get_blob_stream(object_id oid);
 
+	// Return false if the repository has no usable bitmaps, or if some
+	// of the reachable objects are outside the bitmapped pack.
+	bool reachable_objects(std::vector<object_id> const & tips, object_bitmap & objects);
+	bool objects_of_type(object_type type, object_bitmap & objects);
+	object_id bitmap_object_id(size_t pos);
+	file_offset_t bitmap_object_disk_size(size_t pos);
+
 	object_id get_ref(string_view ref);
 	object_id get_ref(string_view ref, std::string & real_ref);
 
+	void set_delta_base_cache_limit(size_t limit);
+	cache_stats delta_base_cache_stats() const;
+
+	void set_verify_policy(verify_policy policy);
+
 private:
 	struct impl;
 	impl * m_pimpl;
@@ -117,7 +232,38 @@ public:
 
 	typedef std::map<std::string, file_status> status_t;
 
-	void status(status_t & st, git_ignore const & ign);
+	struct status_options
+	{
+		// The stat data of files that turn out to be unchanged
+		// is written back to the index, so they aren't hashed again.
+		bool refresh_index;
+
+		// Directories are compared on this many threads, 0 uses one per core.
+		size_t thread_count;
+
+		// If `gh fsmonitor` watches the working tree, only the directories
+		// where something changed since the last status are compared, the rest
+		// is taken from the result saved back then, which assumes the same `ign`.
+		bool use_fsmonitor;
+
+		status_options()
+			: refresh_index(false), thread_count(0), use_fsmonitor(false)
+		{
+		}
+	};
+
+	// Receives the paths as they're found, in the order of git trees, i.e. directories
+	// sort as if their name ended with a slash.
+	typedef std::function<void (string_view name, file_status fs)> status_callback;
+
+	// Directories unchanged since git wrote the index's untracked cache aren't listed,
+	// their untracked files are taken from the cache. With `use_fsmonitor`, the paths
+	// are only reported once the walk is done, since the whole result is saved anyway.
+	void status(status_callback const & cb, git_ignore const & ign, status_options const & opts = status_options());
+	void commit_status(status_callback const & cb, object_id const & commit_oid);
+	void tree_status(status_callback const & cb, object_id const & tree_oid);
+
+	void status(status_t & st, git_ignore const & ign, status_options const & opts = status_options());
 	void commit_status(status_t & st, object_id const & commit_oid);
 	void tree_status(status_t & st, object_id const & tree_oid);
 
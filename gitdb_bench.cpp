@@ -0,0 +1,193 @@
+#include "gitdb.h"
+#include "file.h"
+#include "sha1.h"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+static void store_be32(std::string & s, uint32_t v)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		s += (char)(v >> shift);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Object names are uniformly distributed, like those of real objects.
+static std::vector<object_id> make_oids(size_t count)
+{
+	std::vector<object_id> res;
+	res.reserve(count);
+	for (size_t i = 0; i != count; ++i)
+	{
+		char buf[32];
+		sprintf(buf, "%u", (unsigned)i);
+		res.push_back(sha1(buf));
+	}
+	return res;
+}
+
+// Only the .idx matters for lookups, the pack is just its header.
+static void write_pack(std::string const & repo_path, std::vector<object_id> oids)
+{
+	std::sort(oids.begin(), oids.end());
+
+	std::string idx = "\xfftOc";
+	store_be32(idx, 2);
+
+	size_t pos = 0;
+	for (size_t i = 0; i < 256; ++i)
+	{
+		while (pos != oids.size() && oids[pos][0] <= i)
+			++pos;
+		store_be32(idx, (uint32_t)pos);
+	}
+
+	for (object_id const & oid: oids)
+		idx.append(oid.begin(), oid.end());
+	for (size_t i = 0; i != oids.size(); ++i)
+		store_be32(idx, 0);
+	for (size_t i = 0; i != oids.size(); ++i)
+		store_be32(idx, 12);
+	idx.append(40, '\0');
+
+	std::string pack = "PACK";
+	store_be32(pack, 2);
+	store_be32(pack, (uint32_t)oids.size());
+	pack.append(20, '\0');
+
+	file::create(repo_path + "/objects/pack/pack-bench.idx", idx);
+	file::create(repo_path + "/objects/pack/pack-bench.pack", pack);
+}
+
+// Reports how many objects per second `gitdb::has_object` finds in packs
+// of increasing size, looking them up in random order.
+static void bench_pack_lookup()
+{
+	size_t const lookup_count = 1000000;
+
+	for (size_t object_count: { 10000, 100000, 1000000, 4000000 })
+	{
+		std::string repo_path = "gitdb_bench.git";
+		make_directory(repo_path);
+		gitdb::create(repo_path);
+
+		std::vector<object_id> oids = make_oids(object_count);
+		write_pack(repo_path, oids);
+
+		std::vector<object_id> queries;
+		queries.reserve(lookup_count);
+		for (size_t i = 0; i != lookup_count; ++i)
+			queries.push_back(oids[(i * 2654435761u) % object_count]);
+
+		size_t found = 0;
+		double secs;
+		{
+			gitdb db;
+			db.open(repo_path);
+
+			// The first lookup loads the packs.
+			db.has_object(queries[0]);
+
+			auto start = std::chrono::steady_clock::now();
+			for (object_id const & oid: queries)
+				found += db.has_object(oid);
+			secs = seconds_since(start);
+		}
+
+		file::remove(repo_path + "/objects/pack/pack-bench.idx");
+		file::remove(repo_path + "/objects/pack/pack-bench.pack");
+
+		if (found != lookup_count)
+		{
+			fprintf(stderr, "error: only %u of %u objects found\n", (unsigned)found, (unsigned)lookup_count);
+			return;
+		}
+
+		printf("pack lookup: %8u objects: %6.2f M lookups/s\n", (unsigned)object_count, lookup_count / secs / 1e6);
+	}
+}
+
+// Reports the throughput of `sha1_state` with each block transform the processor
+// supports, then that of `sha1_many` against hashing the same messages one by one.
+static void bench_sha1()
+{
+	std::vector<uint8_t> data(64 * 1024 * 1024);
+	for (size_t i = 0; i != data.size(); ++i)
+		data[i] = (uint8_t)(i * 2654435761u >> 24);
+
+	struct impl_name
+	{
+		sha1_impl impl;
+		char const * name;
+	};
+
+	impl_name const impls[] = {
+		{ sha1_impl::generic, "generic" },
+		{ sha1_impl::x86_sha, "x86 SHA" },
+		{ sha1_impl::armv8, "ARMv8 SHA" },
+	};
+
+	size_t const rounds = 4;
+	for (impl_name const & in: impls)
+	{
+		if (!sha1_select_impl(in.impl))
+			continue;
+
+		uint8_t hash[20];
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i != rounds; ++i)
+		{
+			sha1_state ss;
+			ss.add(data.data(), data.data() + data.size());
+			ss.finish(hash);
+		}
+		double secs = seconds_since(start);
+
+		printf("sha1 %-10s %6.2f GB/s\n", in.name, rounds * data.size() / secs / 1e9);
+	}
+
+	sha1_select_impl(sha1_impl::best);
+
+	// Messages about the size of small trees.
+	size_t const message_size = 256;
+	std::vector<string_view> messages;
+	for (size_t offs = 0; offs + message_size <= data.size(); offs += message_size)
+		messages.push_back(string_view((char const *)data.data() + offs, (char const *)data.data() + offs + message_size));
+
+	std::vector<uint8_t> hashes(20 * messages.size());
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i != messages.size(); ++i)
+		sha1(hashes.data() + 20 * i, messages[i]);
+	double each_secs = seconds_since(start);
+
+	start = std::chrono::steady_clock::now();
+	sha1_many(hashes.data(), messages.data(), messages.size());
+	double many_secs = seconds_since(start);
+
+	printf("sha1 %u-byte messages: one by one %6.2f GB/s, sha1_many %6.2f GB/s\n", (unsigned)message_size,
+		data.size() / each_secs / 1e9, data.size() / many_secs / 1e9);
+}
+
+int main()
+{
+	try
+	{
+		bench_sha1();
+		bench_pack_lookup();
+	}
+	catch (std::exception const & e)
+	{
+		fprintf(stderr, "error: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -17,121 +17,371 @@ void git_ignore::load(string_view prefix, istream & fin)
 	}
 }
 
-static bool fnmatch(string_view pattern, string_view str)
+// Matches a bracket expression, e.g. `[a-z]` or `[!0-9]`, against `ch`.
+// Returns the end of the expression, or `first` if it isn't terminated.
+static char const * match_class(char const * first, char const * last, char ch, bool & matched)
 {
-	char const * pat_first = pattern.begin();
-	char const * pat_last = pattern.end();
+	char const * cur = first + 1;
+	bool negated = cur != last && (*cur == '!' || *cur == '^');
+	if (negated)
+		++cur;
 
-	char const * str_first = str.begin();
-	char const * str_last = str.end();
+	matched = false;
 
-	for (; pat_first != pat_last; ++pat_first)
+	// A `]` right after the opening bracket is part of the class.
+	for (char const * class_first = cur; cur != last && (cur == class_first || *cur != ']');)
 	{
-		if (*pat_first == '*')
+		char lo = *cur++;
+		if (lo == '\\' && cur != last)
+			lo = *cur++;
+
+		char hi = lo;
+		if (cur != last && *cur == '-' && cur + 1 != last && cur[1] != ']')
+		{
+			++cur;
+			hi = *cur++;
+			if (hi == '\\' && cur != last)
+				hi = *cur++;
+		}
+
+		if ((uint8_t)lo <= (uint8_t)ch && (uint8_t)ch <= (uint8_t)hi)
+			matched = true;
+	}
+
+	if (cur == last)
+		return first;
+
+	matched = matched != negated;
+	return cur + 1;
+}
+
+// Matches the token of a glob at `p` against `ch` and moves past it.
+static bool match_token(char const *& p, char const * last, char ch)
+{
+	if (*p == '?')
+	{
+		++p;
+		return true;
+	}
+
+	if (*p == '[')
+	{
+		bool matched;
+		char const * next = match_class(p, last, ch, matched);
+		if (next != p)
+		{
+			p = next;
+			return matched;
+		}
+	}
+
+	if (*p == '\\' && p + 1 != last)
+		++p;
+	return *p++ == ch;
+}
+
+// Matches a glob against a single path component. When a token fails to match,
+// only the last `*` is made to absorb one more character, as any earlier one
+// couldn't do better, so this never takes more than quadratic time.
+static bool match_component(string_view glob, string_view str)
+{
+	char const * p = glob.begin();
+	char const * s = str.begin();
+
+	char const * star_p = 0;
+	char const * star_s = 0;
+
+	while (s != str.end())
+	{
+		if (p != glob.end() && *p == '*')
+		{
+			while (p != glob.end() && *p == '*')
+				++p;
+			if (p == glob.end())
+				return true;
+
+			star_p = p;
+			star_s = s;
+			continue;
+		}
+
+		if (p != glob.end() && match_token(p, glob.end(), *s))
 		{
-			++pat_first;
-			if (pat_first != pat_last && *pat_first == '*')
+			++s;
+			continue;
+		}
+
+		if (!star_p)
+			return false;
+
+		p = star_p;
+		s = ++star_s;
+	}
+
+	while (p != glob.end() && *p == '*')
+		++p;
+	return p == glob.end();
+}
+
+// Splits off the first component of a path.
+static string_view next_component(char const *& cur, char const * last)
+{
+	char const * first = cur;
+	while (cur != last && *cur != '/')
+		++cur;
+
+	string_view res(first, cur);
+	if (cur != last)
+		++cur;
+	return res;
+}
+
+// Matches a glob against a path one component at a time; `**` components match
+// any number of components, which are searched for like `match_component` does.
+// As in git's wildmatch, a trailing `**` matches what's inside a directory, not
+// the directory itself. It's still reported as a match for the directory, with
+// `content_only` set, which a file of the same name doesn't get.
+static bool match_path(string_view glob, string_view path, bool is_dir, bool & content_only)
+{
+	char const * p = glob.begin();
+	char const * s = path.begin();
+
+	char const * star_p = 0;
+	char const * star_s = 0;
+
+	while (s != path.end())
+	{
+		if (p != glob.end())
+		{
+			char const * p_next = p;
+			string_view glob_comp = next_component(p_next, glob.end());
+			if (glob_comp == "**")
 			{
-				if (pat_first == pat_last)
-					return true;
-
-				for (char const * cur = str_first; cur != str_last; ++cur)
-				{
-					if (fnmatch(string_view(pat_first + 1, pat_last), string_view(cur, str_last)))
-						return true;
-				}
+				p = star_p = p_next;
+				star_s = s;
+				continue;
 			}
-			else
+
+			char const * s_next = s;
+			if (match_component(glob_comp, next_component(s_next, path.end())))
 			{
-				if (pat_first == pat_last)
-					return true;
-
-				for (char const * cur = str_first; cur != str_last && *cur != '/'; ++cur)
-				{
-					if (fnmatch(string_view(pat_first, pat_last), string_view(cur, str_last)))
-						return true;
-				}
+				p = p_next;
+				s = s_next;
+				continue;
 			}
-
-			return false;
 		}
 
-		if (str_first == str_last || *pat_first != *str_first)
+		if (!star_p)
 			return false;
 
-		++str_first;
+		p = star_p;
+		next_component(star_s, path.end());
+		s = star_s;
+	}
+
+	content_only = p != glob.end();
+	while (p != glob.end())
+	{
+		if (next_component(p, glob.end()) != "**" || !is_dir)
+			return false;
 	}
 
-	return str_first == str_last;
+	return true;
 }
 
-bool git_ignore::match(string_view path) const
+// Whether a glob may match something inside the directory `dir`,
+// i.e. its leading components match those of `dir` and there are more.
+static bool may_match_inside(string_view glob, string_view dir)
 {
-	for (auto && pattern : m_patterns)
+	char const * p = glob.begin();
+	char const * s = dir.begin();
+
+	while (s != dir.end())
 	{
-		if (fnmatch(pattern, path))
+		if (p == glob.end())
+			return false;
+
+		string_view glob_comp = next_component(p, glob.end());
+		if (glob_comp == "**")
 			return true;
+		if (!match_component(glob_comp, next_component(s, dir.end())))
+			return false;
 	}
 
-	if (m_parent)
-		return m_parent->match(path);
+	return p != glob.end();
+}
+
+// Whether a negated pattern following the one at `idx` may match something
+// inside the directory `name`.
+bool git_ignore::may_reinclude(size_t idx, string_view name) const
+{
+	for (size_t i = idx + 1; i < m_patterns.size(); ++i)
+	{
+		pattern const & pat = m_patterns[i];
+		if (!pat.negated)
+			continue;
+
+		// Patterns for a directory inside this one apply to its content.
+		if (pat.base.size() > name.size() && starts_with(pat.base, name) && pat.base[name.size()] == '/')
+			return true;
+
+		if (name.size() <= pat.base.size() || !starts_with(name, pat.base))
+			continue;
+
+		if (!pat.anchored || may_match_inside(pat.glob, name.substr(pat.base.size())))
+			return true;
+	}
 
 	return false;
 }
 
-void git_ignore::add_pattern(string_view prefix, string_view pat)
+bool git_ignore::matches(size_t idx, string_view name, string_view basename, bool is_dir) const
 {
-	if (pat.empty() || pat[0] == '#')
-		return;
+	pattern const & pat = m_patterns[idx];
 
-	bool invert = false;
-	if (pat[0] == '!')
+	if (pat.dir_only && !is_dir)
+		return false;
+
+	if (name.size() <= pat.base.size() || !starts_with(name, pat.base))
+		return false;
+
+	if (pat.anchored)
 	{
-		invert = true;
-		pat = pat.substr(1);
+		// A directory is taken as ignored when all of its content matches, so
+		// that status doesn't look inside, unless something there may be re-included.
+		// With `dir/**/`, its files don't match.
+		bool content_only;
+		if (!match_path(pat.glob, name.substr(pat.base.size()), is_dir, content_only))
+			return false;
+		return !content_only || (!pat.dir_only && !this->may_reinclude(idx, name));
 	}
 
-	std::string unescaped;
-	char const * first = pat.data();
-	char const * last = first + pat.size();
-	for (char const * cur = first; cur != last; ++cur)
-	{
-		if (*cur == '\\' && cur + 1 != last)
+	return match_component(pat.glob, basename);
+}
+
+git_ignore::pattern const * git_ignore::last_match(string_view name, string_view basename, bool is_dir) const
+{
+	// One past the position of the last matching pattern found so far.
+	size_t found = 0;
+
+	auto search = [&](std::vector<size_t> const & candidates) {
+		for (auto it = candidates.rbegin(); it != candidates.rend() && *it >= found; ++it)
 		{
-			unescaped.append(first, cur);
-			unescaped.append(1, cur[1]);
-			first = cur + 2;
-			++cur;
+			if (this->matches(*it, name, basename, is_dir))
+			{
+				found = *it + 1;
+				break;
+			}
 		}
+	};
+
+	if (!m_names.empty())
+	{
+		auto it = m_names.find(basename);
+		if (it != m_names.end())
+			search(it->second);
 	}
 
-	while (first != last && last[-1] == ' ')
-		--last;
-	unescaped.append(first, last);
+	if (!m_paths.empty())
+	{
+		auto it = m_paths.find(name);
+		if (it != m_paths.end())
+			search(it->second);
+	}
 
-	if (unescaped.empty())
-		return;
+	size_t dot = basename.rfind('.');
+	if (!m_extensions.empty() && dot != basename.size())
+	{
+		auto it = m_extensions.find(basename.substr(dot + 1));
+		if (it != m_extensions.end())
+			search(it->second);
+	}
+
+	search(m_globs);
+
+	return found == 0? 0: &m_patterns[found - 1];
+}
 
-	if (unescaped[0] != '/')
+bool git_ignore::match(string_view path) const
+{
+	for (git_ignore const * ign = this; ign; ign = ign->m_parent)
 	{
-		m_patterns.push_back(prefix + unescaped);
-		if (unescaped.back() != '/')
-			m_patterns.push_back(prefix + unescaped + "/");
+		bool ignored;
+		if (ign->try_match(path, ignored))
+			return ignored;
+	}
+
+	return false;
+}
+
+bool git_ignore::try_match(string_view path, bool & ignored) const
+{
+	bool is_dir = ends_with(path, "/");
+	string_view name = is_dir? path.trim_right(1): path;
 
-		unescaped = "**/" + unescaped;
-		m_patterns.push_back(prefix + unescaped);
-		if (unescaped.back() != '/')
-			m_patterns.push_back(prefix + unescaped + "/");
+	size_t slash = name.rfind('/');
+	string_view basename = slash == name.size()? name: name.substr(slash + 1);
 
+	pattern const * pat = this->last_match(name, basename, is_dir);
+	if (!pat)
+		return false;
+
+	ignored = !pat->negated;
+	return true;
+}
+
+void git_ignore::add_pattern(string_view prefix, string_view pat)
+{
+	if (pat.empty() || pat[0] == '#')
 		return;
-	}
 
-	unescaped.erase(unescaped.begin());
+	pattern p;
+	p.base = prefix;
 
-	if (unescaped.empty())
+	p.negated = pat[0] == '!';
+	if (p.negated)
+		pat = pat.substr(1);
+
+	// Trailing spaces are dropped, unless escaped.
+	char const * first = pat.begin();
+	char const * last = pat.end();
+	while (last != first && last[-1] == ' ' && !(last - first >= 2 && last[-2] == '\\'))
+		--last;
+
+	p.dir_only = last != first && last[-1] == '/';
+	if (p.dir_only)
+		--last;
+
+	bool rooted = last != first && *first == '/';
+	if (rooted)
+		++first;
+
+	if (first == last)
 		return;
 
-	m_patterns.push_back(prefix + unescaped);
-	if (unescaped.back() != '/')
-		m_patterns.push_back(prefix + unescaped + "/");
+	p.glob.assign(first, last);
+	p.anchored = rooted || p.glob.find('/') != std::string::npos;
+
+	static char const wildcards[] = "*?[\\";
+
+	size_t idx = m_patterns.size();
+	size_t wild = p.glob.find_first_of(wildcards);
+	if (wild == std::string::npos)
+	{
+		if (p.anchored)
+			m_paths[p.base + p.glob].push_back(idx);
+		else
+			m_names[p.glob].push_back(idx);
+	}
+	else if (!p.anchored && wild == 0 && p.glob.find_first_of(wildcards, 1) == std::string::npos
+		&& p.glob.find('.') != std::string::npos)
+	{
+		m_extensions[p.glob.substr(p.glob.rfind('.') + 1)].push_back(idx);
+	}
+	else
+	{
+		m_globs.push_back(idx);
+	}
+
+	m_patterns.push_back(std::move(p));
 }
@@ -3,6 +3,7 @@
 
 #include "string_view.h"
 #include "stream.h"
+#include <unordered_map>
 #include <vector>
 #include <string>
 
@@ -13,11 +14,46 @@ public:
 
 	void load(string_view prefix, istream & fin);
 	void add_pattern(string_view prefix, string_view pat);
+
+	// Paths of directories end with a slash. As in git, the last pattern matching
+	// the path decides, and those added here take precedence over the parent's.
 	bool match(string_view path) const;
 
+	// Like `match`, but only looks at the patterns added here
+	// and returns false if none of them matches.
+	bool try_match(string_view path, bool & ignored) const;
+
 private:
+	struct pattern
+	{
+		// The directory the pattern was loaded for, with a trailing slash.
+		std::string base;
+
+		// Without the leading `!`, leading and trailing slashes.
+		std::string glob;
+
+		bool negated;
+		bool dir_only;
+
+		// Patterns containing a slash match the path relative
+		// to `base`, the others match any file's name under it.
+		bool anchored;
+	};
+
+	pattern const * last_match(string_view name, string_view basename, bool is_dir) const;
+	bool matches(size_t idx, string_view name, string_view basename, bool is_dir) const;
+	bool may_reinclude(size_t idx, string_view name) const;
+
 	git_ignore const * m_parent;
-	std::vector<std::string> m_patterns;
+	std::vector<pattern> m_patterns;
+
+	// The patterns that are literal names, literal paths and `*.ext`
+	// patterns, keyed by the name, the path and the extension respectively.
+	// The rest is matched one by one. All are in the order they were added.
+	std::unordered_map<std::string, std::vector<size_t> > m_names;
+	std::unordered_map<std::string, std::vector<size_t> > m_paths;
+	std::unordered_map<std::string, std::vector<size_t> > m_extensions;
+	std::vector<size_t> m_globs;
 };
 
 #endif // IGNORE_H
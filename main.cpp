@@ -1,4 +1,5 @@
 #include "gitdb.h"
+#include "fsmonitor.h"
 #include "text_reader.h"
 #include "file.h"
 #include <time.h>
@@ -17,6 +18,9 @@ namespace gh_opts {
 		bare,
 		wd_dir,
 		ref,
+		refresh,
+		threads,
+		fsmonitor,
 	};
 };
 
@@ -41,6 +45,10 @@ static cmdline_entry const cmdline_entries[] =
 
 	{ gh_opts::wd_dir, 0, "wd_dir", "", 0, gh_subparser::test_checkout, "" },
 	{ gh_opts::ref, 0, "ref", "", 0, gh_subparser::test_checkout, "" },
+
+	{ gh_opts::refresh, 0, "--refresh", "", 0, gh_subparser::status, "write the stat data of unchanged files back to the index" },
+	{ gh_opts::threads, 'j', "--threads", "0", 1, gh_subparser::status, "the number of threads to scan the working dir with (0 for one per core)" },
+	{ gh_opts::fsmonitor, 0, "--fsmonitor", "", 0, gh_subparser::status, "only scan what changed since the last status, as reported by `gh fsmonitor`" },
 };
 
 void print_stream(istream & s)
@@ -54,7 +62,7 @@ void print_stream(istream & s)
 	}
 }
 
-static void checkout_tree(gitdb & db, string_view dir, gitdb::tree_t const & t)
+static void checkout_tree(gitdb & db, string_view dir, gitdb::tree_view const & t)
 {
 	for (auto && te: t)
 	{
@@ -67,7 +75,7 @@ static void checkout_tree(gitdb & db, string_view dir, gitdb::tree_t const & t)
 		else if (te.mode & 0x4000)
 		{
 			make_directory(name);
-			checkout_tree(db, name, db.get_tree(te.oid));
+			checkout_tree(db, name, db.get_tree_view(te.oid));
 		}
 		else
 		{
@@ -125,21 +133,26 @@ static bool open_wd(gitdb & db, git_wd & wd, string_view path)
 	return false;
 }
 
-static void print_status(std::map<std::string, git_wd::file_status> const & fs, bool untracked)
+static void print_status(string_view name, git_wd::file_status fs, bool untracked)
 {
-	for (auto && kv : fs)
-	{
-		char const * stati = untracked? "?DM": "ADM";
-		uint8_t const colors[] = { untracked? 0xe: 0xa, 0xa, 0xc };
+	char const * stati = untracked? "?DM": "ADM";
+	uint8_t const colors[] = { untracked? 0xe: 0xa, 0xa, 0xc };
 
-		console_color_guard concolor(colors[static_cast<int>(kv.second)]);
-		std::cout << stati[static_cast<int>(kv.second)] << " " << kv.first << "\n";
-	}
+	console_color_guard concolor(colors[static_cast<int>(fs)]);
+	std::cout << stati[static_cast<int>(fs)] << " ";
+	std::cout.write(name.data(), name.size());
+	std::cout << "\n";
 }
 
 static int gh_status(cmdline & args)
 {
 	std::string repo_arg = args.pop_string(gh_opts::repo);
+	git_wd::status_options opts;
+	opts.refresh_index = args.pop_switch(gh_opts::refresh);
+	opts.use_fsmonitor = args.pop_switch(gh_opts::fsmonitor);
+
+	int threads = atoi(args.pop_string(gh_opts::threads).c_str());
+	opts.thread_count = threads < 0? 0: threads;
 
 	gitdb db;
 	git_wd wd;
@@ -153,21 +166,44 @@ static int gh_status(cmdline & args)
 	object_id head_oid = db.get_ref("HEAD", real_ref);
 	std::cout << "B " << real_ref << "\n";
 
-	std::map<std::string, git_wd::file_status> fs;
+	// Entries are printed as they're found.
+	bool staged = false;
+	wd.commit_status([&staged](string_view name, git_wd::file_status fs) {
+		print_status(name, fs, /*untracked=*/false);
+		staged = true;
+	}, head_oid);
 
-	wd.commit_status(fs, head_oid);
-	if (!fs.empty())
-	{
-		print_status(fs, /*untracked=*/false);
+	if (staged)
 		std::cout << "\n";
-		fs.clear();
-	}
 
 	git_ignore ign;
 	ign.add_pattern("", "/.git");
-	wd.status(fs, ign);
-	print_status(fs, /*untracked=*/true);
+	wd.status([](string_view name, git_wd::file_status fs) {
+		print_status(name, fs, /*untracked=*/true);
+	}, ign, opts);
+
+	return 0;
+}
+
+static int gh_fsmonitor(cmdline & args)
+{
+	std::string repo_arg = args.pop_string(gh_opts::repo);
+
+	// The daemon runs for a long time, it mustn't keep the repository open.
+	std::string wd_path;
+	{
+		gitdb db;
+		git_wd wd;
+		if (!open_wd(db, wd, repo_arg))
+		{
+			std::cerr << "error: not a git repository: " << repo_arg << "\n";
+			return 2;
+		}
+
+		wd_path = wd.path();
+	}
 
+	fsmonitor_run(wd_path);
 	return 0;
 }
 
@@ -221,13 +257,17 @@ int main(int argc, char * argv[])
 
 				object_id head_oid = db0.get_ref(subargs.pop_string(gh_opts::ref));
 				gitdb::commit_t cc = db0.get_commit(head_oid);
-				checkout_tree(db0, subargs.pop_string(gh_opts::wd_dir), db0.get_tree(cc.tree_oid));
+				checkout_tree(db0, subargs.pop_string(gh_opts::wd_dir), db0.get_tree_view(cc.tree_oid));
 				r = 0;
 			}
 			else if (cmd == "st" || cmd == "status")
 			{
 				r = gh_status(subargs);
 			}
+			else if (cmd == "fsmonitor")
+			{
+				r = gh_fsmonitor(subargs);
+			}
 		}
 
 		return r;
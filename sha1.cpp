@@ -1,67 +1,881 @@
 #include "sha1.h"
 #include "stream.h"
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SHA1_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(_M_ARM64)
+#define SHA1_ARM64
+#include <windows.h>
+#include <arm_neon.h>
+#endif
+
+// MSVC lets any function use any instructions, others have to be told.
+#if defined(__GNUC__) || defined(__clang__)
+#define SHA1_TARGET(features) __attribute__((target(features)))
+#else
+#define SHA1_TARGET(features)
+#endif
+
+static uint32_t const sha1_iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
 static uint32_t lrot(uint32_t x, int s)
 {
 	return _rotl(x, s);
 }
 
-static void transform_block(uint32_t (&h)[5], uint8_t const block[64])
+static void sha1_round(uint32_t & a, uint32_t & b, uint32_t & c, uint32_t & d, uint32_t & e, uint32_t f, uint32_t k, uint32_t w)
+{
+	uint32_t temp = lrot(a, 5) + f + e + k + w;
+	e = d;
+	d = c;
+	c = lrot(b, 30);
+	b = a;
+	a = temp;
+}
+
+static void transform_blocks_generic(uint32_t (&h)[5], uint8_t const * p, size_t count)
 {
-	uint32_t w[80];
-	for (int i = 0; i < 16; ++i)
+	for (; count != 0; --count, p += 64)
 	{
-		w[i] = load_be<uint32_t>(block);
-		block += 4;
+		uint32_t w[80];
+		for (int i = 0; i < 16; ++i)
+			w[i] = load_be<uint32_t>(p + 4 * i);
+
+		for (int i = 16; i < 80; ++i)
+			w[i] = lrot((w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16]), 1);
+
+		uint32_t a = h[0];
+		uint32_t b = h[1];
+		uint32_t c = h[2];
+		uint32_t d = h[3];
+		uint32_t e = h[4];
+
+		int i = 0;
+		for (; i < 20; ++i)
+			sha1_round(a, b, c, d, e, d ^ (b & (c ^ d)), 0x5A827999, w[i]);
+		for (; i < 40; ++i)
+			sha1_round(a, b, c, d, e, b ^ c ^ d, 0x6ED9EBA1, w[i]);
+		for (; i < 60; ++i)
+			sha1_round(a, b, c, d, e, (b & c) | (d & (b | c)), 0x8F1BBCDC, w[i]);
+		for (; i < 80; ++i)
+			sha1_round(a, b, c, d, e, b ^ c ^ d, 0xCA62C1D6, w[i]);
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
 	}
+}
 
-	for (int i = 16; i < 80; ++i)
-		w[i] = lrot((w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16]), 1);
+#ifdef SHA1_X86
 
-	uint32_t a = h[0];
-	uint32_t b = h[1];
-	uint32_t c = h[2];
-	uint32_t d = h[3];
-	uint32_t e = h[4];
+static void cpuid(int (&regs)[4], int leaf)
+{
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, 0);
+#else
+	unsigned int eax, ebx, ecx, edx;
+	__cpuid_count(leaf, 0, eax, ebx, ecx, edx);
+	regs[0] = (int)eax;
+	regs[1] = (int)ebx;
+	regs[2] = (int)ecx;
+	regs[3] = (int)edx;
+#endif
+}
+
+// Whether the OS preserves the registers enabled in `mask` of XCR0.
+SHA1_TARGET("xsave")
+static bool os_saves_state(unsigned long long mask)
+{
+	return (_xgetbv(0) & mask) == mask;
+}
+
+struct x86_features
+{
+	bool sha;
+	bool avx2;
+	bool avx512;
+};
+
+static x86_features detect_x86_features()
+{
+	x86_features res = {};
+
+	int regs[4];
+	cpuid(regs, 0);
+	if (regs[0] < 7)
+		return res;
+
+	cpuid(regs, 1);
+	int ecx1 = regs[2];
+
+	cpuid(regs, 7);
+	int ebx7 = regs[1];
+
+	// SSSE3 and SSE4.1 are needed besides SHA.
+	res.sha = (ecx1 & (1 << 9)) != 0 && (ecx1 & (1 << 19)) != 0 && (ebx7 & (1 << 29)) != 0;
+
+	// OSXSAVE must be checked before `xgetbv` can be used. AVX-512 needs
+	// both F and BW, and the opmask and zmm registers to be saved.
+	bool osxsave = (ecx1 & (1 << 27)) != 0;
+	res.avx2 = osxsave && (ebx7 & (1 << 5)) != 0 && os_saves_state(0x6);
+	res.avx512 = osxsave && (ebx7 & (1 << 16)) != 0 && (ebx7 & (1 << 30)) != 0 && os_saves_state(0xe6);
+	return res;
+}
+
+static x86_features const & cpu_features()
+{
+	static x86_features const res = detect_x86_features();
+	return res;
+}
 
-	for (int i = 0; i < 80; ++i)
+// Each `_mm_sha1rnds4_epu32` does four rounds. The next four words of the
+// schedule are computed from the last sixteen by `_mm_sha1msg1_epu32`,
+// a xor and `_mm_sha1msg2_epu32`, interleaved with the rounds, and
+// `_mm_sha1nexte_epu32` adds them to `e`, which it derives from `a`
+// as it was four rounds earlier.
+SHA1_TARGET("sha,ssse3,sse4.1")
+static void transform_blocks_shani(uint32_t (&h)[5], uint8_t const * p, size_t count)
+{
+	__m128i const bswap = _mm_set_epi64x(0x0001020304050607ll, 0x08090a0b0c0d0e0fll);
+
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const *)h), 0x1b);
+	__m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+	__m128i e1;
+
+	for (; count != 0; --count, p += 64)
 	{
-		uint32_t f, k;
+		__m128i abcd_save = abcd;
+		__m128i e_save = e0;
 
-		if (i < 20)
-		{
-			f = (b & c) | (~b & d);
-			k = 0x5A827999;
-		}
-		else if (i < 40)
-		{
-			f = b ^ c ^ d;
-			k = 0x6ED9EBA1;
-		}
-		else if (i < 60)
+		// Rounds 0-15 take the words of the block.
+		__m128i msg0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)p), bswap);
+		e0 = _mm_add_epi32(e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		__m128i msg1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(p + 16)), bswap);
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+		__m128i msg2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(p + 32)), bswap);
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		__m128i msg3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(p + 48)), bswap);
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		// Rounds 16-63 all look the same, except for the round function.
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		// The schedule winds down over rounds 64-79.
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+	h[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+SHA1_TARGET("avx2")
+static __m256i lrot_avx2(__m256i x, int s)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, s), _mm256_srli_epi32(x, 32 - s));
+}
+
+// Loads eight words at `offset` of each of the eight blocks
+// and transposes them, so that `w[i]` has word i of each block.
+SHA1_TARGET("avx2")
+static void load_lanes_avx2(__m256i * w, uint8_t const * const (&blocks)[8], size_t offset)
+{
+	__m256i const bswap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+	__m256i r[8];
+	for (int j = 0; j < 8; ++j)
+		r[j] = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i const *)(blocks[j] + offset)), bswap);
+
+	__m256i t[8];
+	for (int j = 0; j < 8; j += 2)
+	{
+		t[j] = _mm256_unpacklo_epi32(r[j], r[j + 1]);
+		t[j + 1] = _mm256_unpackhi_epi32(r[j], r[j + 1]);
+	}
+
+	// Each 128-bit half of `r[4 * m + s]` now has words 4 * half + s of blocks 4 * m to 4 * m + 3.
+	for (int m = 0; m < 8; m += 4)
+	{
+		r[m] = _mm256_unpacklo_epi64(t[m], t[m + 2]);
+		r[m + 1] = _mm256_unpackhi_epi64(t[m], t[m + 2]);
+		r[m + 2] = _mm256_unpacklo_epi64(t[m + 1], t[m + 3]);
+		r[m + 3] = _mm256_unpackhi_epi64(t[m + 1], t[m + 3]);
+	}
+
+	for (int s = 0; s < 4; ++s)
+	{
+		w[s] = _mm256_permute2x128_si256(r[s], r[s + 4], 0x20);
+		w[s + 4] = _mm256_permute2x128_si256(r[s], r[s + 4], 0x31);
+	}
+}
+
+SHA1_TARGET("avx2")
+static __m256i schedule_avx2(__m256i (&w)[16], int i)
+{
+	__m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(i - 3) & 15], w[(i - 8) & 15]), _mm256_xor_si256(w[(i - 14) & 15], w[i & 15]));
+	return w[i & 15] = lrot_avx2(x, 1);
+}
+
+SHA1_TARGET("avx2")
+static void sha1_round_avx2(__m256i & a, __m256i & b, __m256i & c, __m256i & d, __m256i & e, __m256i f, __m256i k, __m256i w)
+{
+	__m256i temp = _mm256_add_epi32(_mm256_add_epi32(lrot_avx2(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, k), w));
+	e = d;
+	d = c;
+	c = lrot_avx2(b, 30);
+	b = a;
+	a = temp;
+}
+
+// Does the same as `transform_blocks_generic` for a block of each of
+// eight messages, one per 32-bit lane of the ymm registers.
+SHA1_TARGET("avx2")
+static void transform_lanes_avx2(uint32_t (&h)[5][8], uint8_t const * const (&blocks)[8])
+{
+	__m256i w[16];
+	load_lanes_avx2(w, blocks, 0);
+	load_lanes_avx2(w + 8, blocks, 32);
+
+	__m256i a = _mm256_loadu_si256((__m256i const *)h[0]);
+	__m256i b = _mm256_loadu_si256((__m256i const *)h[1]);
+	__m256i c = _mm256_loadu_si256((__m256i const *)h[2]);
+	__m256i d = _mm256_loadu_si256((__m256i const *)h[3]);
+	__m256i e = _mm256_loadu_si256((__m256i const *)h[4]);
+
+	__m256i k = _mm256_set1_epi32(0x5A827999);
+	int i = 0;
+	for (; i < 16; ++i)
+		sha1_round_avx2(a, b, c, d, e, _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))), k, w[i]);
+	for (; i < 20; ++i)
+		sha1_round_avx2(a, b, c, d, e, _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))), k, schedule_avx2(w, i));
+
+	k = _mm256_set1_epi32(0x6ED9EBA1);
+	for (; i < 40; ++i)
+		sha1_round_avx2(a, b, c, d, e, _mm256_xor_si256(_mm256_xor_si256(b, c), d), k, schedule_avx2(w, i));
+
+	k = _mm256_set1_epi32(0x8F1BBCDC);
+	for (; i < 60; ++i)
+		sha1_round_avx2(a, b, c, d, e, _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c))), k, schedule_avx2(w, i));
+
+	k = _mm256_set1_epi32(0xCA62C1D6);
+	for (; i < 80; ++i)
+		sha1_round_avx2(a, b, c, d, e, _mm256_xor_si256(_mm256_xor_si256(b, c), d), k, schedule_avx2(w, i));
+
+	_mm256_storeu_si256((__m256i *)h[0], _mm256_add_epi32(a, _mm256_loadu_si256((__m256i const *)h[0])));
+	_mm256_storeu_si256((__m256i *)h[1], _mm256_add_epi32(b, _mm256_loadu_si256((__m256i const *)h[1])));
+	_mm256_storeu_si256((__m256i *)h[2], _mm256_add_epi32(c, _mm256_loadu_si256((__m256i const *)h[2])));
+	_mm256_storeu_si256((__m256i *)h[3], _mm256_add_epi32(d, _mm256_loadu_si256((__m256i const *)h[3])));
+	_mm256_storeu_si256((__m256i *)h[4], _mm256_add_epi32(e, _mm256_loadu_si256((__m256i const *)h[4])));
+}
+
+// Like `load_lanes_avx2`, but loads the whole blocks.
+SHA1_TARGET("avx512f,avx512bw")
+static void load_lanes_avx512(__m512i (&w)[16], uint8_t const * const (&blocks)[16])
+{
+	__m512i const bswap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+
+	__m512i r[16];
+	for (int j = 0; j < 16; ++j)
+		r[j] = _mm512_shuffle_epi8(_mm512_loadu_si512(blocks[j]), bswap);
+
+	__m512i t[16];
+	for (int j = 0; j < 16; j += 2)
+	{
+		t[j] = _mm512_unpacklo_epi32(r[j], r[j + 1]);
+		t[j + 1] = _mm512_unpackhi_epi32(r[j], r[j + 1]);
+	}
+
+	// Each 128-bit quarter q of `r[4 * m + s]` now has words 4 * q + s of blocks 4 * m to 4 * m + 3.
+	for (int m = 0; m < 16; m += 4)
+	{
+		r[m] = _mm512_unpacklo_epi64(t[m], t[m + 2]);
+		r[m + 1] = _mm512_unpackhi_epi64(t[m], t[m + 2]);
+		r[m + 2] = _mm512_unpacklo_epi64(t[m + 1], t[m + 3]);
+		r[m + 3] = _mm512_unpackhi_epi64(t[m + 1], t[m + 3]);
+	}
+
+	for (int s = 0; s < 4; ++s)
+	{
+		__m512i x0 = _mm512_shuffle_i32x4(r[s], r[s + 4], 0x44);
+		__m512i x1 = _mm512_shuffle_i32x4(r[s], r[s + 4], 0xee);
+		__m512i x2 = _mm512_shuffle_i32x4(r[s + 8], r[s + 12], 0x44);
+		__m512i x3 = _mm512_shuffle_i32x4(r[s + 8], r[s + 12], 0xee);
+
+		w[s] = _mm512_shuffle_i32x4(x0, x2, 0x88);
+		w[s + 4] = _mm512_shuffle_i32x4(x0, x2, 0xdd);
+		w[s + 8] = _mm512_shuffle_i32x4(x1, x3, 0x88);
+		w[s + 12] = _mm512_shuffle_i32x4(x1, x3, 0xdd);
+	}
+}
+
+SHA1_TARGET("avx512f")
+static __m512i schedule_avx512(__m512i (&w)[16], int i)
+{
+	__m512i x = _mm512_ternarylogic_epi32(w[(i - 3) & 15], w[(i - 8) & 15], w[(i - 14) & 15], 0x96);
+	return w[i & 15] = _mm512_rol_epi32(_mm512_xor_si512(x, w[i & 15]), 1);
+}
+
+SHA1_TARGET("avx512f")
+static void sha1_round_avx512(__m512i & a, __m512i & b, __m512i & c, __m512i & d, __m512i & e, __m512i f, __m512i k, __m512i w)
+{
+	__m512i temp = _mm512_add_epi32(_mm512_add_epi32(_mm512_rol_epi32(a, 5), f), _mm512_add_epi32(_mm512_add_epi32(e, k), w));
+	e = d;
+	d = c;
+	c = _mm512_rol_epi32(b, 30);
+	b = a;
+	a = temp;
+}
+
+// Sixteen lanes in the zmm registers. The round functions are
+// single `vpternlogd`s: 0xca is choose, 0x96 parity and 0xe8 majority.
+SHA1_TARGET("avx512f,avx512bw")
+static void transform_lanes_avx512(uint32_t (&h)[5][16], uint8_t const * const (&blocks)[16])
+{
+	__m512i w[16];
+	load_lanes_avx512(w, blocks);
+
+	__m512i a = _mm512_loadu_si512(h[0]);
+	__m512i b = _mm512_loadu_si512(h[1]);
+	__m512i c = _mm512_loadu_si512(h[2]);
+	__m512i d = _mm512_loadu_si512(h[3]);
+	__m512i e = _mm512_loadu_si512(h[4]);
+
+	__m512i k = _mm512_set1_epi32(0x5A827999);
+	int i = 0;
+	for (; i < 16; ++i)
+		sha1_round_avx512(a, b, c, d, e, _mm512_ternarylogic_epi32(b, c, d, 0xca), k, w[i]);
+	for (; i < 20; ++i)
+		sha1_round_avx512(a, b, c, d, e, _mm512_ternarylogic_epi32(b, c, d, 0xca), k, schedule_avx512(w, i));
+
+	k = _mm512_set1_epi32(0x6ED9EBA1);
+	for (; i < 40; ++i)
+		sha1_round_avx512(a, b, c, d, e, _mm512_ternarylogic_epi32(b, c, d, 0x96), k, schedule_avx512(w, i));
+
+	k = _mm512_set1_epi32(0x8F1BBCDC);
+	for (; i < 60; ++i)
+		sha1_round_avx512(a, b, c, d, e, _mm512_ternarylogic_epi32(b, c, d, 0xe8), k, schedule_avx512(w, i));
+
+	k = _mm512_set1_epi32(0xCA62C1D6);
+	for (; i < 80; ++i)
+		sha1_round_avx512(a, b, c, d, e, _mm512_ternarylogic_epi32(b, c, d, 0x96), k, schedule_avx512(w, i));
+
+	_mm512_storeu_si512(h[0], _mm512_add_epi32(a, _mm512_loadu_si512(h[0])));
+	_mm512_storeu_si512(h[1], _mm512_add_epi32(b, _mm512_loadu_si512(h[1])));
+	_mm512_storeu_si512(h[2], _mm512_add_epi32(c, _mm512_loadu_si512(h[2])));
+	_mm512_storeu_si512(h[3], _mm512_add_epi32(d, _mm512_loadu_si512(h[3])));
+	_mm512_storeu_si512(h[4], _mm512_add_epi32(e, _mm512_loadu_si512(h[4])));
+}
+
+#endif // SHA1_X86
+
+#ifdef SHA1_ARM64
+
+static bool has_sha_extensions()
+{
+	return ::IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE) != 0;
+}
+
+// Each of `vsha1cq_u32`, `vsha1pq_u32` and `vsha1mq_u32` does four rounds with
+// the corresponding round function, given the words of the schedule with
+// the constant already added. `e` for the next four rounds is derived from `a`
+// by `vsha1h_u32`. The schedule is computed by `vsha1su0q_u32` and `vsha1su1q_u32`.
+static void transform_blocks_armv8(uint32_t (&h)[5], uint8_t const * p, size_t count)
+{
+	uint32x4_t const k0 = vdupq_n_u32(0x5A827999);
+	uint32x4_t const k1 = vdupq_n_u32(0x6ED9EBA1);
+	uint32x4_t const k2 = vdupq_n_u32(0x8F1BBCDC);
+	uint32x4_t const k3 = vdupq_n_u32(0xCA62C1D6);
+
+	uint32x4_t abcd = vld1q_u32(h);
+	uint32_t e0 = h[4];
+	uint32_t e1;
+
+	for (; count != 0; --count, p += 64)
+	{
+		uint32x4_t abcd_save = abcd;
+		uint32_t e_save = e0;
+
+		uint32x4_t msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+		uint32x4_t msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16)));
+		uint32x4_t msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 32)));
+		uint32x4_t msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 48)));
+
+		uint32x4_t tmp0 = vaddq_u32(msg0, k0);
+		uint32x4_t tmp1 = vaddq_u32(msg1, k0);
+
+		// Rounds 0-19
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg2, k0);
+		msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg3, k0);
+		msg0 = vsha1su1q_u32(msg0, msg3);
+		msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg0, k0);
+		msg1 = vsha1su1q_u32(msg1, msg0);
+		msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg1, k1);
+		msg2 = vsha1su1q_u32(msg2, msg1);
+		msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1cq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg2, k1);
+		msg3 = vsha1su1q_u32(msg3, msg2);
+		msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+
+		// Rounds 20-39
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg3, k1);
+		msg0 = vsha1su1q_u32(msg0, msg3);
+		msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg0, k1);
+		msg1 = vsha1su1q_u32(msg1, msg0);
+		msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg1, k1);
+		msg2 = vsha1su1q_u32(msg2, msg1);
+		msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg2, k2);
+		msg3 = vsha1su1q_u32(msg3, msg2);
+		msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg3, k2);
+		msg0 = vsha1su1q_u32(msg0, msg3);
+		msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+
+		// Rounds 40-59
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg0, k2);
+		msg1 = vsha1su1q_u32(msg1, msg0);
+		msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg1, k2);
+		msg2 = vsha1su1q_u32(msg2, msg1);
+		msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg2, k2);
+		msg3 = vsha1su1q_u32(msg3, msg2);
+		msg0 = vsha1su0q_u32(msg0, msg1, msg2);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg3, k3);
+		msg0 = vsha1su1q_u32(msg0, msg3);
+		msg1 = vsha1su0q_u32(msg1, msg2, msg3);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1mq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg0, k3);
+		msg1 = vsha1su1q_u32(msg1, msg0);
+		msg2 = vsha1su0q_u32(msg2, msg3, msg0);
+
+		// Rounds 60-79
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg1, k3);
+		msg2 = vsha1su1q_u32(msg2, msg1);
+		msg3 = vsha1su0q_u32(msg3, msg0, msg1);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e0, tmp0);
+		tmp0 = vaddq_u32(msg2, k3);
+		msg3 = vsha1su1q_u32(msg3, msg2);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+		tmp1 = vaddq_u32(msg3, k3);
+
+		e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e0, tmp0);
+
+		e0 = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+		abcd = vsha1pq_u32(abcd, e1, tmp1);
+
+		e0 += e_save;
+		abcd = vaddq_u32(abcd, abcd_save);
+	}
+
+	vst1q_u32(h, abcd);
+	h[4] = e0;
+}
+
+#endif // SHA1_ARM64
+
+typedef void transform_blocks_fn(uint32_t (&h)[5], uint8_t const * p, size_t count);
+
+static transform_blocks_fn * select_transform_blocks()
+{
+#if defined(SHA1_X86)
+	if (cpu_features().sha)
+		return &transform_blocks_shani;
+#elif defined(SHA1_ARM64)
+	if (has_sha_extensions())
+		return &transform_blocks_armv8;
+#endif
+	return &transform_blocks_generic;
+}
+
+static transform_blocks_fn *& transform_blocks_impl()
+{
+	static transform_blocks_fn * impl = select_transform_blocks();
+	return impl;
+}
+
+// Uses the processor's SHA instructions if it has them.
+static void transform_blocks(uint32_t (&h)[5], uint8_t const * p, size_t count)
+{
+	transform_blocks_impl()(h, p, count);
+}
+
+bool sha1_select_impl(sha1_impl impl)
+{
+	transform_blocks_fn * fn = 0;
+	switch (impl)
+	{
+	case sha1_impl::best:
+		fn = select_transform_blocks();
+		break;
+	case sha1_impl::generic:
+		fn = &transform_blocks_generic;
+		break;
+	case sha1_impl::x86_sha:
+#if defined(SHA1_X86)
+		if (cpu_features().sha)
+			fn = &transform_blocks_shani;
+#endif
+		break;
+	case sha1_impl::armv8:
+#if defined(SHA1_ARM64)
+		if (has_sha_extensions())
+			fn = &transform_blocks_armv8;
+#endif
+		break;
+	}
+
+	if (!fn)
+		return false;
+
+	transform_blocks_impl() = fn;
+	return true;
+}
+
+// A message being hashed in one lane of a multi-buffer transform. After its
+// whole blocks, the rest of the message is padded in `tail`.
+struct sha1_lane
+{
+	size_t msg;
+
+	uint8_t const * p;
+	size_t blocks;
+
+	uint8_t const * tail_p;
+	size_t tail_blocks;
+	uint8_t tail[128];
+};
+
+static void start_lane(sha1_lane & lane, size_t msg, string_view data)
+{
+	lane.msg = msg;
+	lane.p = (uint8_t const *)data.begin();
+	lane.blocks = data.size() / 64;
+
+	size_t rem = data.size() % 64;
+	std::copy(lane.p + lane.blocks * 64, lane.p + data.size(), lane.tail);
+	lane.tail[rem] = 0x80;
+	lane.tail_blocks = rem < 56? 1: 2;
+
+	uint8_t * len_p = lane.tail + lane.tail_blocks * 64 - 8;
+	std::fill(lane.tail + rem + 1, len_p, 0);
+	store_be(len_p, (uint64_t)data.size() * 8);
+	lane.tail_p = lane.tail;
+}
+
+static uint8_t const * next_lane_block(sha1_lane & lane)
+{
+	uint8_t const * block;
+	if (lane.blocks != 0)
+	{
+		block = lane.p;
+		lane.p += 64;
+		--lane.blocks;
+	}
+	else
+	{
+		block = lane.tail_p;
+		lane.tail_p += 64;
+		--lane.tail_blocks;
+	}
+
+	return block;
+}
+
+static bool lane_done(sha1_lane const & lane)
+{
+	return lane.blocks == 0 && lane.tail_blocks == 0;
+}
+
+// Hashes messages `N` at a time for as long as there are enough of them
+// to keep all lanes busy. The last ones are finished one by one.
+template <int N>
+static void sha1_lanes(uint8_t * hashes, string_view const * messages, size_t count,
+	void (*transform)(uint32_t (&h)[5][N], uint8_t const * const (&blocks)[N]))
+{
+	sha1_lane lanes[N];
+	uint32_t h[5][N];
+	uint8_t const * blocks[N];
+
+	size_t next = 0;
+	auto start = [&](int j) {
+		start_lane(lanes[j], next, messages[next]);
+		++next;
+
+		for (int i = 0; i < 5; ++i)
+			h[i][j] = sha1_iv[i];
+	};
+
+	if (count >= N)
+	{
+		for (int j = 0; j < N; ++j)
+			start(j);
+
+		for (bool busy = true; busy;)
 		{
-			f = (b & c) | (b & d) | (c & d);
-			k = 0x8F1BBCDC;
+			for (int j = 0; j < N; ++j)
+				blocks[j] = next_lane_block(lanes[j]);
+
+			transform(h, blocks);
+
+			for (int j = 0; j < N; ++j)
+			{
+				if (!lane_done(lanes[j]))
+					continue;
+
+				uint8_t * hash = hashes + 20 * lanes[j].msg;
+				for (int i = 0; i < 5; ++i)
+					store_be(hash + 4 * i, h[i][j]);
+
+				if (next != count)
+					start(j);
+				else
+					busy = false;
+			}
 		}
-		else if (i < 80)
+
+		for (int j = 0; j < N; ++j)
 		{
-			f = b ^ c ^ d;
-			k = 0xCA62C1D6;
-		}
+			if (lane_done(lanes[j]))
+				continue;
 
-		uint32_t temp = lrot(a, 5) + f + e + k + w[i];
-		e = d;
-		d = c;
-		c = lrot(b, 30);
-		b = a;
-		a = temp;
+			uint32_t lane_h[5];
+			for (int i = 0; i < 5; ++i)
+				lane_h[i] = h[i][j];
+
+			transform_blocks(lane_h, lanes[j].p, lanes[j].blocks);
+			transform_blocks(lane_h, lanes[j].tail_p, lanes[j].tail_blocks);
+
+			uint8_t * hash = hashes + 20 * lanes[j].msg;
+			for (int i = 0; i < 5; ++i)
+				store_be(hash + 4 * i, lane_h[i]);
+		}
 	}
 
-	h[0] += a;
-	h[1] += b;
-	h[2] += c;
-	h[3] += d;
-	h[4] += e;
+	for (; next != count; ++next)
+		sha1(hashes + 20 * next, messages[next]);
+}
+
+static void sha1_each(uint8_t * hashes, string_view const * messages, size_t count)
+{
+	for (size_t i = 0; i != count; ++i)
+		sha1(hashes + 20 * i, messages[i]);
+}
+
+#ifdef SHA1_X86
+static void sha1_lanes_avx2(uint8_t * hashes, string_view const * messages, size_t count)
+{
+	sha1_lanes<8>(hashes, messages, count, &transform_lanes_avx2);
+}
+
+static void sha1_lanes_avx512(uint8_t * hashes, string_view const * messages, size_t count)
+{
+	sha1_lanes<16>(hashes, messages, count, &transform_lanes_avx512);
+}
+#endif
+
+typedef void sha1_many_fn(uint8_t * hashes, string_view const * messages, size_t count);
+
+static sha1_many_fn * select_sha1_many()
+{
+#ifdef SHA1_X86
+	// Sixteen lanes are faster than the SHA instructions, eight aren't.
+	if (cpu_features().avx512)
+		return &sha1_lanes_avx512;
+	if (cpu_features().avx2 && !cpu_features().sha)
+		return &sha1_lanes_avx2;
+#endif
+	return &sha1_each;
+}
+
+void sha1_many(uint8_t * hashes, string_view const * messages, size_t count)
+{
+	static sha1_many_fn * const impl = select_sha1_many();
+	impl(hashes, messages, count);
 }
 
 sha1_state::sha1_state()
@@ -71,11 +885,7 @@ sha1_state::sha1_state()
 
 void sha1_state::reset()
 {
-	m_h[0] = 0x67452301;
-	m_h[1] = 0xEFCDAB89;
-	m_h[2] = 0x98BADCFE;
-	m_h[3] = 0x10325476;
-	m_h[4] = 0xC3D2E1F0;
+	std::copy(sha1_iv, sha1_iv + 5, m_h);
 	m_message_len = 0;
 }
 
@@ -94,13 +904,11 @@ void sha1_state::add(uint8_t const * first, uint8_t const * last)
 
 	std::copy(first, first + rem, block_start);
 	first += rem;
-	transform_block(m_h, m_block);
+	transform_blocks(m_h, m_block, 1);
 
-	while (last - first >= 64)
-	{
-		transform_block(m_h, first);
-		first += 64;
-	}
+	size_t count = (last - first) / 64;
+	transform_blocks(m_h, first, count);
+	first += count * 64;
 
 	std::copy(first, last, m_block);
 }
@@ -129,13 +937,13 @@ void sha1_state::finish(uint8_t * hash)
 	if (sublen > 56)
 	{
 		std::fill(m_block + sublen, m_block + 64, 0);
-		transform_block(m_h, m_block);
+		transform_blocks(m_h, m_block, 1);
 		sublen = 0;
 	}
 
 	std::fill(m_block + sublen, m_block + 56, 0);
 	store_be(m_block + 56, m_message_len * 8);
-	transform_block(m_h, m_block);
+	transform_blocks(m_h, m_block, 1);
 
 	store_be(hash, m_h[0]);
 	store_be(hash + 4, m_h[1]);
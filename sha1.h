@@ -25,4 +25,22 @@ private:
 void sha1(uint8_t * hash, string_view data);
 void sha1(uint8_t * hash, istream & s);
 
+// Hashes `count` independent messages, several at a time across the lanes
+// of vector registers where that's faster. Stores 20 bytes per message to `hashes`.
+void sha1_many(uint8_t * hashes, string_view const * messages, size_t count);
+
+// The implementations of the block transform used by `sha1_state` and `sha1`.
+// The best one the processor supports is used, unless a benchmark picks another;
+// this must happen while nothing is being hashed. Returns false if `impl`
+// isn't supported here.
+enum class sha1_impl
+{
+	best,
+	generic,
+	x86_sha,
+	armv8,
+};
+
+bool sha1_select_impl(sha1_impl impl);
+
 #endif // SHA1_H
@@ -44,35 +44,29 @@ void read_all(istream & s, uint8_t * p, size_t size)
 
 std::vector<uint8_t> read_all(istream & s, size_t size)
 {
-	std::vector<uint8_t> res;
-
-	while (res.size() != size)
-	{
-		uint8_t buf[1024];
-		size_t r = s.read(buf, (std::min)(size - res.size(), sizeof buf));
-		if (r == 0)
-			break;
-
-		res.insert(res.end(), buf, buf + r);
-	}
-
+	std::vector<uint8_t> res(size);
+	res.resize(read_up_to(s, res.data(), res.size()));
 	return res;
 }
 
 std::vector<uint8_t> read_all(istream & s)
 {
-	std::vector<uint8_t> res;
+	std::vector<uint8_t> res(4096);
+	size_t size = 0;
 
 	for (;;)
 	{
-		uint8_t buf[1024];
-		size_t r = s.read(buf, sizeof buf);
+		if (size == res.size())
+			res.resize(2 * res.size());
+
+		size_t r = s.read(res.data() + size, res.size() - size);
 		if (r == 0)
 			break;
 
-		res.insert(res.end(), buf, buf + r);
+		size += r;
 	}
 
+	res.resize(size);
 	return res;
 }
 
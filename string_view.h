@@ -201,6 +201,11 @@ inline bool starts_with(string_view s, string_view prefix)
 	return prefix.size() <= s.size() && std::equal(prefix.begin(), prefix.end(), s.begin());
 }
 
+inline bool ends_with(string_view s, string_view suffix)
+{
+	return suffix.size() <= s.size() && std::equal(suffix.begin(), suffix.end(), s.end() - suffix.size());
+}
+
 inline int cmp(string_view lhs, string_view rhs)
 {
 	size_t min_size = (std::min)(lhs.size(), rhs.size());
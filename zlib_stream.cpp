@@ -1,5 +1,7 @@
 #include "zlib_stream.h"
 #include <stdexcept>
+#include <algorithm>
+#include <limits.h>
 
 class zlib_error
 	: public std::runtime_error
@@ -15,13 +17,25 @@ private:
 };
 
 zlib_istream::zlib_istream(istream & s)
-	: m_s(s), m_z(), m_done(false)
+	: m_s(&s), m_z(), m_done(false)
 {
 	int r = inflateInit(&m_z);
 	if (r != Z_OK)
 		throw zlib_error(r);
 }
 
+// Inflates directly from memory (e.g. a mapped pack), the input is never copied.
+zlib_istream::zlib_istream(uint8_t const * first, uint8_t const * last)
+	: m_s(0), m_z(), m_done(false)
+{
+	m_z.next_in = const_cast<uint8_t *>(first);
+	m_z.avail_in = (uInt)(std::min)(last - first, (ptrdiff_t)UINT_MAX);
+
+	int r = inflateInit(&m_z);
+	if (r != Z_OK)
+		throw zlib_error(r);
+}
+
 zlib_istream::~zlib_istream()
 {
 	inflateEnd(&m_z);
@@ -29,19 +43,24 @@ zlib_istream::~zlib_istream()
 
 size_t zlib_istream::read(uint8_t * p, size_t capacity)
 {
+	if (capacity == 0)
+		return 0;
+
 	m_z.next_out = p;
-	m_z.avail_out = capacity;
+	m_z.avail_out = (uInt)(std::min)(capacity, (size_t)UINT_MAX);
 
-	while (!m_done && m_z.next_out == p)
+	while (!m_done && m_z.next_out == p && m_z.avail_out != 0)
 	{
-		if (m_z.avail_in == 0)
+		if (m_z.avail_in == 0 && m_s)
 		{
-			m_inbuf_size = m_s.read(m_inbuf, sizeof m_inbuf);
+			m_inbuf_size = m_s->read(m_inbuf, sizeof m_inbuf);
 			m_z.next_in = m_inbuf;
 			m_z.avail_in = m_inbuf_size;
 		}
 
-		int r = inflate(&m_z, 0);
+		// When all of the input is in memory and `p` can take the rest of the output,
+		// `Z_FINISH` has zlib inflate in a single call, without keeping a window.
+		int r = inflate(&m_z, m_s? Z_NO_FLUSH: Z_FINISH);
 		switch (r)
 		{
 		case Z_OK:
@@ -49,6 +68,11 @@ size_t zlib_istream::read(uint8_t * p, size_t capacity)
 		case Z_STREAM_END:
 			m_done = true;
 			break;
+		case Z_BUF_ERROR:
+			// With `Z_FINISH`, this only means that `p` is full.
+			if (!m_s && m_z.avail_out == 0)
+				break;
+			throw zlib_error(r);
 		default:
 			throw zlib_error(r);
 		}
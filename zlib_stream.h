@@ -8,13 +8,14 @@ class zlib_istream
 	: public istream
 {
 public:
-	zlib_istream(istream & s);
+	explicit zlib_istream(istream & s);
+	zlib_istream(uint8_t const * first, uint8_t const * last);
 	~zlib_istream();
 
 	size_t read(uint8_t * p, size_t capacity) override;
 
 private:
-	istream & m_s;
+	istream * m_s;
 	z_stream m_z;
 
 	uint8_t m_inbuf[1024];